@@ -0,0 +1,58 @@
+/* body.h
+ * What differs from one camera body to the next.
+ *
+ * Each body gets a descriptor here with the command words it uses where
+ * bodies differ, the length of the packets that go with them, and the gaps
+ * it leaves during power-up.  fakebody plays one body, picked at compile
+ * time with its BODY option, so every field it uses is a constant.
+ * fakelens can't know in advance, so it works out which body it's talking
+ * to from the standby command, which is the first command that differs, and
+ * reads the rest from the table in program memory.
+ *
+ * Only the E-PL1 has been watched on a logic analyzer so far.  The E-P1
+ * asks for its standby packet with a different command; everything else
+ * is assumed to be the same until a capture says otherwise.  A new body
+ * needs an entry in BodyModel and a descriptor, in the same order.
+ */
+
+#ifndef BODY_H_
+#define BODY_H_
+
+#include "typedef.h"
+#include "progmem.h"
+#include "commands.h"
+#include "standby.h"
+
+enum BodyModel {
+  BODY_EPL1,
+  BODY_EP1,
+  BODY_MODELS
+};
+
+struct BodyProfile
+{
+  char name[8];
+  uint32 standby; // Command for the standby packet
+  uint8 standbyBytes; // Payload of its response
+  uint16 wakeMs; // From SLEEP going high to the wake-up handshake
+  uint16 firstCommandMs; // From the wake-up handshake to CMD_INIT
+  uint16 commandGapUs; // Between the other commands during power-up
+  uint16 focusSetupPauseMs; // In the extra handshake after CMD_FOCUS_SETUP
+};
+
+constexpr BodyProfile bodyProfiles[BODY_MODELS] PROGMEM = {
+  {"E-PL1", CMD_STANDBY, STANDBY_BYTES, 10, 20, 1000, 0},
+  {"E-P1", CMD_STANDBY_EP1, STANDBY_BYTES, 10, 20, 1000, 0}
+};
+
+// Returns the body that uses the given standby command, or BODY_MODELS
+inline BodyModel bodyFromStandby(uint32 command)
+{
+  uint8 b = 0;
+  while(b < BODY_MODELS && pgm_read_dword(&bodyProfiles[b].standby) != command){
+    b++;
+  }
+  return((BodyModel)b);
+}
+
+#endif /* BODY_H_ */
@@ -0,0 +1,155 @@
+/* cadence.cpp
+ * Frame timing from the tick timer's output compares.  See cadence.h.
+ */
+
+#include "cadence.h"
+#include "hal.h"
+
+// Alarms are set at most this far ahead, so that the 16-bit compare can't
+// be confused about which way round the count is
+#define MAX_ALARM 0x8000
+
+static uint16 rate; // Frames per second
+static uint32 period; // Ticks per frame, in 24.8 fixed point
+static uint8 phase; // Fraction of a tick carried into the next frame
+static uint16 alarm; // Tick the frame alarm is set for
+static uint32 left; // Ticks from that alarm to the next frame start
+
+static volatile uint16 frameStart; // Tick the current frame started on
+static volatile uint16 frames = 0; // Frames started
+static uint16 handled = 0; // Frames whose slot cadenceWaitSlot() has returned
+
+// How late the frame interrupt ran, in ticks, since the last report
+static volatile uint16 lateMin;
+static volatile uint16 lateMax;
+static volatile uint32 lateTotal;
+static volatile uint16 lateCount;
+static uint16 overruns = 0; // Frames whose slot we missed entirely
+
+// Sets the alarm for the next part of the wait until the next frame
+static void nextAlarm()
+{
+  uint16 step = left > MAX_ALARM ? MAX_ALARM : left;
+  alarm += step;
+  left -= step;
+  setTickAlarmA(alarm);
+}
+
+/* Starts a frame every 1/rate seconds, beginning about a frame from now.
+ * The period is worked out to 1/256 of a tick, so even rates which don't
+ * divide the tick rate come out right on average. */
+void cadenceStart(uint16 frameRate)
+{
+  tickTimerStart();
+  noInterrupts();
+  rate = frameRate;
+  period = (uint32)TICKS_PER_US * 1000000UL * 256 / rate;
+  phase = 0;
+  alarm = ticks();
+  left = period >> 8;
+  lateCount = 0;
+  nextAlarm();
+  interrupts();
+}
+
+ISR(TICK_ALARM_A_vect)
+{
+  uint16 late = ticks() - alarm;
+  if(left){
+    nextAlarm(); // Still on the way to the next frame
+    return;
+  }
+
+  setShutter(HIGH);
+  setTickAlarmB(alarm + SHUTTER_US * TICKS_PER_US);
+  frameStart = alarm;
+  frames++;
+
+  if(lateCount == 0 || late < lateMin){
+    lateMin = late;
+  }
+  if(lateCount == 0 || late > lateMax){
+    lateMax = late;
+  }
+  lateTotal = (lateCount == 0 ? 0 : lateTotal) + late;
+  lateCount++;
+
+  uint32 next = period + phase;
+  phase = next & 0xff;
+  left = next >> 8;
+  nextAlarm();
+}
+
+ISR(TICK_ALARM_B_vect)
+{
+  setShutter(LOW);
+  cancelTickAlarmB();
+}
+
+/* Waits for the bus slot of the next frame we haven't handled yet, and
+ * returns that frame's number.  If the last frame ran long enough to miss
+ * one or more slots, they are counted as overruns and skipped. */
+uint16 cadenceWaitSlot()
+{
+  uint16 started;
+  uint16 start;
+  do{
+    spin();
+    noInterrupts();
+    started = frames;
+    start = frameStart;
+    interrupts();
+  } while(started == handled);
+
+  overruns += started - handled - 1;
+  handled = started;
+
+  while((uint16)(ticks() - start) < SLOT_DELAY_US * TICKS_PER_US){
+    spin();
+  }
+  return(started);
+}
+
+/* Time left before the next frame starts.  Below 31 Hz a frame is longer
+ * than the tick count goes round in, so this counts down to the alarm that's
+ * set, which is never more than MAX_ALARM ahead, and adds whatever is left
+ * of the frame beyond it. */
+uint32 cadenceLeftUs()
+{
+  noInterrupts();
+  uint16 toAlarm = alarm - ticks();
+  uint32 beyond = left;
+  interrupts();
+  if(toAlarm > MAX_ALARM){
+    toAlarm = 0; // Gone off, and its interrupt is on the way
+  }
+  return((beyond + toAlarm) / TICKS_PER_US);
+}
+
+/* Prints the frame rate and how late the shutter pulses have been since the
+ * last report, and starts over. */
+void cadenceReport()
+{
+  noInterrupts();
+  uint16 count = lateCount;
+  uint16 lo = lateMin;
+  uint16 hi = lateMax;
+  uint32 total = lateTotal;
+  lateCount = 0;
+  interrupts();
+  if(count == 0){
+    return;
+  }
+
+  Serial.print(rate);
+  Serial.print(F(" Hz, shutter late by "));
+  Serial.print(lo / TICKS_PER_US);
+  Serial.print(F("-"));
+  Serial.print(hi / TICKS_PER_US);
+  Serial.print(F(" us (mean "));
+  Serial.print(total / count / TICKS_PER_US);
+  Serial.print(F("), jitter "));
+  Serial.print((hi - lo) / TICKS_PER_US);
+  Serial.print(F(" us, overruns "));
+  Serial.println(overruns);
+}
@@ -0,0 +1,30 @@
+/* cadence.h
+ * Frame timing for the body.  The camera pulses SHUTTER at the start of
+ * every frame and then polls the lens, so the frame rate sets the pace of
+ * everything on the bus.
+ *
+ * Frames are timed by output compares on the tick timer, so the shutter
+ * pulse comes from an interrupt at an exact multiple of the frame period
+ * (down to a fraction of a tick on average), whatever the main loop is
+ * doing.  The main loop waits for the bus slot in each frame, a fixed time
+ * after the shutter pulse, and does its bus traffic there.  How late the
+ * frame interrupt runs is recorded as the frame jitter.
+ */
+
+#ifndef CADENCE_H_
+#define CADENCE_H_
+
+#include "typedef.h"
+
+// Length of the shutter pulse
+#define SHUTTER_US 500
+
+// From the start of a frame to the standby packet, as the camera does it
+#define SLOT_DELAY_US 2000
+
+void cadenceStart(uint16 rate);
+uint16 cadenceWaitSlot();
+uint32 cadenceLeftUs();
+void cadenceReport();
+
+#endif /* CADENCE_H_ */
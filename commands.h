@@ -0,0 +1,87 @@
+/* commands.h
+ * The bus commands we know about, and what follows each one on the bus.
+ *
+ * Commands are written as 32-bit values with the first byte sent in the low
+ * bits, which is how fakelens matches them.  fakebody sends these, fakelens
+ * builds its command table from them, and the sniffer and the capture
+ * decoder (decode.cpp) use the kinds to tell where each transaction ends.
+ * The table of kinds lives in program memory.
+ */
+
+#ifndef COMMANDS_H_
+#define COMMANDS_H_
+
+#include "typedef.h"
+#include "progmem.h"
+
+#define CMD_INIT 0x0000f2b0 // First command after power-up
+#define CMD_LENS_ID 0x0000f6c0
+#define CMD_CLOCK_RESET 0x0001f5a0 // Followed by the clock dropping for a ms
+#define CMD_LENS_INFO 0x0000f9c1
+#define CMD_SETUP 0x0000f060 // Four zeros follow; older lenses differ
+#define CMD_STANDBY 0x060180c1 // E-PL1
+#define CMD_STANDBY_EP1 0x020180c1 // E-P1
+#define CMD_EXTENDED_SETUP 0xfe068060
+#define CMD_APERTURE 0x02fe8060
+#define CMD_FOCUS 0xfe038060
+#define CMD_MANUAL_FOCUS 0x00feb0a0 // Ring forward; 0x01feb0a0 is reverse
+#define CMD_FOCUS_SETUP 0x020388b1
+#define CMD_FIRMWARE 0x0000f0c3 // Some kind of firmware dump, 0x08BF bytes
+
+// What follows the command and its checksum
+enum CommandKind {
+  KIND_NONE, // Nothing
+  KIND_RESPONSE, // A packet from the lens
+  KIND_PACKET, // A packet from the body
+  KIND_BYTE, // An extra handshake, and then a single byte from the lens
+  KIND_UNKNOWN // Not a command we know, so we can't tell
+};
+
+struct CommandInfo
+{
+  uint32 command;
+  uint8 kind; // CommandKind
+};
+
+constexpr CommandInfo commandInfo[] PROGMEM = {
+  {CMD_INIT, KIND_BYTE},
+  {CMD_LENS_ID, KIND_RESPONSE},
+  {CMD_CLOCK_RESET, KIND_NONE},
+  {CMD_LENS_INFO, KIND_RESPONSE},
+  {CMD_SETUP, KIND_PACKET},
+  {CMD_STANDBY, KIND_RESPONSE},
+  {CMD_STANDBY_EP1, KIND_RESPONSE},
+  {CMD_EXTENDED_SETUP, KIND_PACKET},
+  {CMD_APERTURE, KIND_PACKET},
+  {CMD_FOCUS, KIND_PACKET},
+  {CMD_MANUAL_FOCUS, KIND_NONE},
+  {CMD_FOCUS_SETUP, KIND_BYTE},
+  {CMD_FIRMWARE, KIND_RESPONSE}
+};
+
+// Looks up what follows a command
+inline CommandKind commandKind(uint32 command)
+{
+  for(uint8 i = 0; i < sizeof(commandInfo) / sizeof(commandInfo[0]); i++){
+    if(pgm_read_dword(&commandInfo[i].command) == command){
+      return((CommandKind)pgm_read_byte(&commandInfo[i].kind));
+    }
+  }
+  return(KIND_UNKNOWN);
+}
+
+// Converts between a command and its bytes in the order they are sent
+inline uint32 commandFromBytes(const uint8* bytes)
+{
+  return((uint32)bytes[0] | ((uint32)bytes[1] << 8) |
+         ((uint32)bytes[2] << 16) | ((uint32)bytes[3] << 24));
+}
+
+inline void commandToBytes(uint32 command, uint8* bytes)
+{
+  for(uint8 i = 0; i < 4; i++){
+    bytes[i] = command >> (8 * i);
+  }
+}
+
+#endif /* COMMANDS_H_ */
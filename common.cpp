@@ -1,3 +1,130 @@
 /* common.cpp
  * Bits of helper code common to the lens and body faking code.
  */
+
+#include "common.h"
+#include "progmem.h"
+
+// The payload starts after the two length bytes
+#define FRAME_HEADER 2
+
+/* Starts sending a packet of nBytes from bytes.  The buffer is only read, so
+ * it's safe to send constant data. */
+void frameBeginSend(Frame& f, const uint8* bytes, uint16 nBytes)
+{
+  f.bytes = (uint8*)bytes;
+  f.length = nBytes + 1;
+  f.capacity = nBytes;
+  f.index = 0;
+  f.checksum = 0;
+  f.summing = true;
+  f.watching = false;
+  f.flash = false;
+}
+
+// Same as above, for a packet whose checksum is already known
+void frameBeginSend(Frame& f, const uint8* bytes, uint16 nBytes, uint8 checksum)
+{
+  frameBeginSend(f, bytes, nBytes);
+  f.checksum = checksum;
+  f.summing = false;
+}
+
+/* Same as the two above, for a packet in program memory, which goes onto
+ * the bus straight from there. */
+void frameBeginSend_P(Frame& f, const uint8* bytes, uint16 nBytes)
+{
+  frameBeginSend(f, bytes, nBytes);
+  f.flash = true;
+}
+
+void frameBeginSend_P(Frame& f, const uint8* bytes, uint16 nBytes, uint8 checksum)
+{
+  frameBeginSend(f, bytes, nBytes, checksum);
+  f.flash = true;
+}
+
+/* Starts receiving a packet into bytes, which has room for capacity bytes of
+ * payload.  The length comes from the packet itself. */
+void frameBeginReceive(Frame& f, uint8* bytes, uint16 capacity)
+{
+  f.bytes = bytes;
+  f.length = 0;
+  f.capacity = capacity;
+  f.index = 0;
+  f.checksum = 0;
+  f.summing = true;
+  f.watching = false;
+  f.flash = false;
+}
+
+/* Starts following a packet going past, for a listener that doesn't take
+ * part in the transaction.  However long it is, the checksum is checked
+ * all the way through but only the first capacity bytes of the payload are
+ * kept. */
+void frameBeginWatch(Frame& f, uint8* bytes, uint16 capacity)
+{
+  frameBeginReceive(f, bytes, capacity);
+  f.watching = true;
+}
+
+/* Starts a 4-byte command.  The body sends it from bytes, and the lens
+ * receives it into bytes. */
+void frameBeginCommand(Frame& f, uint8* bytes)
+{
+  frameBeginReceive(f, bytes, 4);
+  f.length = 4 + 1;
+  f.index = FRAME_HEADER;
+}
+
+// Returns the next byte to send, and moves on past it
+uint8 frameNextByte(Frame& f)
+{
+  uint16 i = f.index++;
+  if(i == 0){
+    return(f.length & 0xff);
+  }
+  if(i == 1){
+    return(f.length >> 8);
+  }
+  if(i <= f.length){
+    const uint8* p = &f.bytes[i - FRAME_HEADER];
+    uint8 value = f.flash ? pgm_read_byte(p) : *p;
+    if(f.summing){
+      f.checksum += value;
+    }
+    return(value);
+  }
+  return(f.checksum);
+}
+
+/* Takes the next byte received, which goes straight into the buffer.
+ * Returns FRAME_MORE until the checksum arrives, and then whether it
+ * matched.  Returns FRAME_TOO_LONG as soon as the length is known if the
+ * payload won't fit, in which case the packet should be abandoned. */
+FrameStatus framePutByte(Frame& f, uint8 value)
+{
+  uint16 i = f.index++;
+  if(i == 0){
+    f.length = value;
+    return(FRAME_MORE);
+  }
+  if(i == 1){
+    f.length |= (uint16)value << 8;
+    if(f.length == 0 || (f.length - 1 > f.capacity && !f.watching)){
+      return(FRAME_TOO_LONG);
+    }
+    return(FRAME_MORE);
+  }
+  if(i <= f.length){
+    if(i - FRAME_HEADER < f.capacity){
+      f.bytes[i - FRAME_HEADER] = value;
+    }
+    f.checksum += value;
+    return(FRAME_MORE);
+  }
+  if(i == f.length + 1){
+    return(value == f.checksum ? FRAME_OK : FRAME_BAD_CHECKSUM);
+  }
+  return(FRAME_TOO_LONG); // Past the end
+}
@@ -5,6 +5,11 @@
  * 26 September 2012
  */
 
+#ifndef COMMON_H_
+#define COMMON_H_
+
+#include "typedef.h"
+
 /* Pin numbers refer to the labels on the Arduino Mega 2560 board.  These
  * numbers are used with the Arduino library.
  *
@@ -16,6 +21,7 @@
 #define BODY_ACK 46 // Port L 3
 #define BODY_ACK_PIN PINL
 #define BODY_ACK_PORT PORTL
+#define BODY_ACK_INT 10 // Port B 4, jumpered to BODY_ACK for its pin change interrupt
 
 #define LENS_ACK 47 // Port L 2
 #define LENS_ACK_PORT PORTL
@@ -37,6 +43,7 @@
 
 #define FOCUS 49 // Port L 0
 #define SHUTTER 48 // Port L 1
+#define SHUTTER_PORT PORTL
 
 #define SPI_SS 53 // When low, the slave SPI is enabled
 
@@ -50,12 +57,14 @@ const uint8 DATA_MISO_HIGH = 0b00001000; // Port B 3
 
 const uint8 LENS_ACK_HIGH = 0b00000100; // Port L 2
 const uint8 BODY_ACK_HIGH = 0b00001000; // Port L 3
+const uint8 SHUTTER_HIGH = 0b00000010; // Port L 1
 
 // Bitwise AND these with port registers to set pins low
 const uint8 CLK_LOW = ~CLK_HIGH;
 const uint8 DATA_LOW = ~DATA_HIGH;
 const uint8 LENS_ACK_LOW = ~LENS_ACK_HIGH;
 const uint8 BODY_ACK_LOW = ~BODY_ACK_HIGH;
+const uint8 SHUTTER_LOW = ~SHUTTER_HIGH;
 
 // Bitwise OR these with port DDR registers to set outputs
 const uint8 CLK_WRITE = 0b00000010; // Port B 1
@@ -65,3 +74,52 @@ const uint8 DATA_MISO_WRITE = 0b00001000; // Port B 3
 
 // Bitwise AND these with port DDR registers to set inputs
 const uint8 DATA_READ = ~DATA_WRITE;
+const uint8 DATA_MOSI_READ = ~DATA_MOSI_WRITE;
+
+/* Packet framing.  Everything after a command goes over the bus as
+ *   length (2 bytes, LSB first), payload, checksum
+ * where the length counts the payload plus the checksum, and the checksum is
+ * the 8-bit sum of the payload.  A command is the same without the length.
+ * The checksum always comes from the lens: it either sends it at the end of
+ * its own packet or echoes it back for one from the body.
+ *
+ * A Frame walks through a packet a byte at a time, reading from or writing
+ * into the caller's buffer directly and keeping the checksum as it goes, so
+ * the same code works from a polling loop or an interrupt. */
+enum FrameStatus
+{
+  FRAME_MORE, // Packet isn't finished yet
+  FRAME_OK, // Complete, and the checksum matched
+  FRAME_BAD_CHECKSUM,
+  FRAME_TOO_LONG // Length doesn't fit in the buffer
+};
+
+struct Frame
+{
+  uint8* bytes; // Payload, in the caller's buffer
+  uint16 length; // Value of the length field
+  uint16 capacity; // Payload bytes the buffer can hold, when receiving
+  uint16 index; // Position in the packet, counting both length bytes
+  uint8 checksum; // Of the payload so far
+  bool summing; // False if the checksum was known from the start
+  bool watching; // Packets of any length are followed, but only capacity kept
+  bool flash; // The bytes being sent are in program memory (see progmem.h)
+};
+
+void frameBeginSend(Frame& f, const uint8* bytes, uint16 nBytes);
+void frameBeginSend(Frame& f, const uint8* bytes, uint16 nBytes, uint8 checksum);
+void frameBeginSend_P(Frame& f, const uint8* bytes, uint16 nBytes);
+void frameBeginSend_P(Frame& f, const uint8* bytes, uint16 nBytes, uint8 checksum);
+void frameBeginReceive(Frame& f, uint8* bytes, uint16 capacity);
+void frameBeginCommand(Frame& f, uint8* bytes);
+void frameBeginWatch(Frame& f, uint8* bytes, uint16 capacity);
+
+uint8 frameNextByte(Frame& f);
+FrameStatus framePutByte(Frame& f, uint8 value);
+
+// True once only the checksum is left
+inline bool frameAtChecksum(const Frame& f) { return(f.index == f.length + 1); }
+inline bool frameDone(const Frame& f) { return(f.index > f.length + 1); }
+inline uint16 framePayloadBytes(const Frame& f) { return(f.length - 1); }
+
+#endif /* COMMON_H_ */
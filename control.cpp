@@ -0,0 +1,135 @@
+/* control.cpp
+ * Interrupt-driven parser for the host command protocol.  See control.h.
+ */
+
+#include "control.h"
+#include "hal.h"
+
+// Slots for commands parsed but not yet taken by the bus loop.  Must be a
+// power of 2.  One is always left empty, so it holds one command fewer.
+#define CONTROL_QUEUE 8
+
+enum ParseState {
+  WAIT_SYNC0,
+  WAIT_SYNC1,
+  WAIT_TAG,
+  WAIT_OPCODE,
+  WAIT_LENGTH,
+  WAIT_ARGS,
+  WAIT_CHECKSUM
+};
+
+/* Only the interrupt moves head, and only controlReceive() moves tail, so
+ * neither has to lock the other out. */
+static HostCommand queue[CONTROL_QUEUE];
+static volatile uint8 head = 0;
+static volatile uint8 tail = 0;
+
+// Parser state, only touched by the interrupt
+static ParseState parse = WAIT_SYNC0;
+static HostCommand* incoming = &queue[0];
+static uint8 nArgs;
+static uint8 checksum;
+
+// Commands thrown away: bad checksum, too long, or no room in the queue
+static volatile uint16 errors = 0;
+
+void controlBegin()
+{
+  uart1ReceiveEnable(); // Already running from telemetryBegin()
+}
+
+/* Takes the next command off the queue, if there is one.  Call this from the
+ * main loop only. */
+bool controlReceive(HostCommand& c)
+{
+  uint8 t = tail;
+  if(t == head){
+    return(false);
+  }
+  c = queue[t];
+  tail = (t + 1) & (CONTROL_QUEUE - 1);
+  return(true);
+}
+
+uint16 controlErrors()
+{
+  noInterrupts();
+  uint16 e = errors;
+  interrupts();
+  return(e);
+}
+
+/* The command is parsed straight into the next free queue slot, and only
+ * handed over once its checksum is good and no byte of it was lost.  If
+ * the queue is full it's parsed anyway, so that we stay in step with the
+ * host, and then dropped. */
+ISR(USART1_RX_vect)
+{
+  bool lost = uart1Overrun(); // Has to be read first
+  uint8 value = uart1Read();
+
+  // Whatever command the lost byte was part of is gone, so look for the
+  // start of the next one
+  if(lost && parse != WAIT_SYNC0){
+    errors++;
+    parse = WAIT_SYNC0;
+  }
+
+  switch(parse){
+  case WAIT_SYNC0:
+    if(value == CONTROL_SYNC0){
+      parse = WAIT_SYNC1;
+    }
+    break;
+
+  case WAIT_SYNC1:
+    parse = (value == CONTROL_SYNC1) ? WAIT_TAG :
+            (value == CONTROL_SYNC0) ? WAIT_SYNC1 : WAIT_SYNC0;
+    break;
+
+  case WAIT_TAG:
+    incoming = &queue[head];
+    incoming->tag = value;
+    checksum = value;
+    parse = WAIT_OPCODE;
+    break;
+
+  case WAIT_OPCODE:
+    incoming->opcode = value;
+    checksum += value;
+    parse = WAIT_LENGTH;
+    break;
+
+  case WAIT_LENGTH:
+    checksum += value;
+    if(value > CONTROL_MAX_ARGS){
+      errors++;
+      parse = WAIT_SYNC0;
+      break;
+    }
+    incoming->length = value;
+    nArgs = 0;
+    parse = value ? WAIT_ARGS : WAIT_CHECKSUM;
+    break;
+
+  case WAIT_ARGS:
+    incoming->args[nArgs++] = value;
+    checksum += value;
+    if(nArgs == incoming->length){
+      parse = WAIT_CHECKSUM;
+    }
+    break;
+
+  case WAIT_CHECKSUM:
+    parse = WAIT_SYNC0;
+    uint8 next = (head + 1) & (CONTROL_QUEUE - 1);
+    if(value != checksum || next == tail){
+      errors++;
+    }
+    else{
+      head = next;
+    }
+    break;
+  }
+}
@@ -0,0 +1,64 @@
+/* control.h
+ * Binary command protocol for a host (the F4) to drive the lens through the
+ * body, on the second serial port (RX1, pin 19) at TELEMETRY_BAUD.  The main
+ * serial port is left for text, and its receive interrupt belongs to the
+ * Arduino core anyway.
+ *
+ * Commands are parsed a byte at a time by the receive interrupt, and whole
+ * commands are passed to the bus loop through a lock-free queue.  Each one
+ * is answered with a TELEMETRY_ACK frame (see telemetry.h) carrying the
+ * command's tag, a status, and the first standby response taken after the
+ * command went to the lens, so the host can see what it did.
+ *
+ * A command is, multi-byte fields LSB first:
+ *   0xa5 0x5a     Sync
+ *   tag (1)       Anything the host likes, sent back in the ack
+ *   opcode (1)
+ *   length (1)    Number of argument bytes
+ *   arguments
+ *   checksum (1)  8-bit sum of everything from the tag on
+ * Commands with a bad checksum are dropped without an ack, since the tag
+ * can't be trusted, and counted.  So are any that lose a byte to a receiver
+ * overrun, and any that come in while seven are already waiting.
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include "typedef.h"
+
+#define CONTROL_SYNC0 0xa5
+#define CONTROL_SYNC1 0x5a
+
+// Opcodes and their arguments
+#define CONTROL_APERTURE 0x01 // Aperture value in 1/256 EV (2), as in standby.h
+#define CONTROL_FOCUS 0x02 // Bytes 5-8 of the 03fe focus packet (4), as they are
+#define CONTROL_EXTENDED 0x03 // A whole extended command (4) and its packet (9)
+#define CONTROL_FOCUS_TO 0x04 // Focus position (2), as in the standby packet, which
+                              // the focus controller moves to (see focus.h)
+#define CONTROL_ZOOM_CALIBRATE 0x05 // 1 to start a zoom calibration, 0 to finish
+                                    // it and save the table (1) (see zoomtrack.h)
+
+#define CONTROL_MAX_ARGS 13
+
+// Status in an ack
+#define ACK_OK 0x00 // The lens took it
+#define ACK_BUS_ERROR 0x01 // The lens didn't echo the right checksum
+#define ACK_QUEUE_FULL 0x02 // Too many commands waiting for the bus
+#define ACK_BAD_COMMAND 0x03 // Unknown opcode, or the wrong number of arguments
+#define ACK_FAILED 0x04 // The body couldn't do it, such as a calibration that
+                        // didn't cover enough points
+
+struct HostCommand
+{
+  uint8 tag;
+  uint8 opcode;
+  uint8 length;
+  uint8 args[CONTROL_MAX_ARGS];
+};
+
+void controlBegin();
+bool controlReceive(HostCommand& c);
+uint16 controlErrors();
+
+#endif /* CONTROL_H_ */
@@ -0,0 +1,147 @@
+/* controltest.cpp
+ * Host-side check of the host command parser and queue in control.cpp.  The
+ * receive interrupt is run directly, one byte at a time, with this file
+ * standing in for the USART; nothing else of the simulator is needed.
+ * Build and run it on the host (see the README); it prints each check that
+ * fails, and exits with 1 if any did.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "control.h"
+#include "hal.h"
+
+static int failures = 0;
+
+#define CHECK(got, expected) check(#got, (got), (expected))
+
+static void check(const char* what, unsigned long got, unsigned long expected)
+{
+  if(got != expected){
+    printf("%s: got 0x%lx, expected 0x%lx\n", what, got, expected);
+    failures++;
+  }
+}
+
+// The USART, as far as control.cpp sees it
+static SimIsr receive; // Its USART1_RX_vect handler
+static uint8 rxByte;
+static bool rxLost;
+
+SimIsrHook::SimIsrHook(SimVector vector, SimIsr isr)
+{
+  if(vector == USART1_RX_vect){
+    receive = isr;
+  }
+}
+
+void simUartReceiveEnable(bool) {}
+uint8 simUartRead() { return(rxByte); }
+bool simUartOverrun() { return(rxLost); }
+void noInterrupts() {}
+void interrupts() {}
+
+// Hands the parser one byte, with DOR1 set if lost
+static void feed(uint8 value, bool lost = false)
+{
+  rxByte = value;
+  rxLost = lost;
+  receive();
+}
+
+/* Sends a whole command.  The checksum is off by badSum, and if lostAt is
+ * a byte's index from the tag on, that byte comes in with DOR1 set. */
+static void feedCommand(uint8 tag, uint8 opcode, const uint8* args, uint8 n,
+                        uint8 badSum = 0, int lostAt = -1)
+{
+  uint8 bytes[3 + CONTROL_MAX_ARGS + 1] = {tag, opcode, n};
+  memcpy(bytes + 3, args, n);
+  uint8 sum = 0;
+  for(uint8 i = 0; i < 3 + n; i++){
+    sum += bytes[i];
+  }
+  bytes[3 + n] = sum + badSum;
+
+  feed(CONTROL_SYNC0);
+  feed(CONTROL_SYNC1);
+  for(int i = 0; i < 3 + n + 1; i++){
+    feed(bytes[i], i == lostAt);
+  }
+}
+
+int main()
+{
+  const uint8 av[2] = {0xb1, 0x03};
+  HostCommand c;
+
+  // A good command is queued as it was sent
+  feedCommand(0x11, CONTROL_APERTURE, av, sizeof(av));
+  CHECK(controlReceive(c), true);
+  CHECK(c.tag, 0x11);
+  CHECK(c.opcode, CONTROL_APERTURE);
+  CHECK(c.length, 2);
+  CHECK(c.args[0] | (c.args[1] << 8), 0x03b1);
+  CHECK(controlReceive(c), false);
+  CHECK(controlErrors(), 0);
+
+  // Noise between commands, and a repeated first sync byte, are skipped
+  feed(0x00);
+  feed(CONTROL_SYNC1);
+  feed(CONTROL_SYNC0);
+  feedCommand(0x12, CONTROL_APERTURE, av, sizeof(av));
+  CHECK(controlReceive(c), true);
+  CHECK(c.tag, 0x12);
+  CHECK(controlErrors(), 0);
+
+  // A bad checksum is dropped and counted
+  feedCommand(0x13, CONTROL_APERTURE, av, sizeof(av), 1);
+  CHECK(controlReceive(c), false);
+  CHECK(controlErrors(), 1);
+
+  // So is one that's too long for a slot
+  uint8 big[CONTROL_MAX_ARGS + 1] = {0};
+  feed(CONTROL_SYNC0);
+  feed(CONTROL_SYNC1);
+  feed(0x14);
+  feed(CONTROL_EXTENDED);
+  feed(sizeof(big));
+  CHECK(controlErrors(), 2);
+
+  // A byte lost to an overrun drops its command, whatever the checksum says
+  feedCommand(0x15, CONTROL_APERTURE, av, sizeof(av), 0, 3);
+  CHECK(controlReceive(c), false);
+  CHECK(controlErrors(), 3);
+
+  // An overrun between commands costs nothing, and the next one gets through
+  feed(0x00, true);
+  feedCommand(0x16, CONTROL_APERTURE, av, sizeof(av));
+  CHECK(controlReceive(c), true);
+  CHECK(c.tag, 0x16);
+  CHECK(controlErrors(), 3);
+
+  // The queue holds seven.  The rest are parsed, to stay in step with the
+  // host, and dropped.
+  for(uint8 i = 0; i < 9; i++){
+    feedCommand(0x20 + i, CONTROL_APERTURE, av, sizeof(av));
+  }
+  CHECK(controlErrors(), 5);
+  for(uint8 i = 0; i < 7; i++){
+    CHECK(controlReceive(c), true);
+    CHECK(c.tag, 0x20 + i);
+  }
+  CHECK(controlReceive(c), false);
+
+  // And there's room again once they're taken
+  feedCommand(0x30, CONTROL_FOCUS_TO, av, sizeof(av));
+  CHECK(controlReceive(c), true);
+  CHECK(c.tag, 0x30);
+  CHECK(c.opcode, CONTROL_FOCUS_TO);
+  CHECK(controlErrors(), 5);
+
+  if(failures){
+    printf("%d checks failed\n", failures);
+    return(1);
+  }
+  printf("All control checks passed\n");
+  return(0);
+}
@@ -0,0 +1,625 @@
+/* decode.cpp
+ * Host tool that turns logic analyzer captures of the bus into a compact,
+ * indexed file of transactions.
+ *
+ *   g++ -O2 -pthread -o decode decode.cpp common.cpp
+ *   ./decode [options] capture out.mftx
+ *
+ * Options:
+ *   --raw RATE       The capture is raw samples taken at RATE Hz, one byte
+ *                    each with channel n in bit n (sigrok-cli -O binary).
+ *                    Otherwise it's a CSV export with the time in seconds and
+ *                    then a column for each channel, a row for each change
+ *                    (Saleae exports, and MFT_SIM_CAPTURE from the simulator).
+ *   --clk N, --data N, --body-ack N, --lens-ack N
+ *                    Channel each line is on; 0, 1, 2 and 3 by default.
+ *   --threads N      Threads to scan with; all the cores by default.
+ *   --replay FILE    Also write what fits as a replaytrace.h for fakelens
+ *                    built with -DREPLAY (see recorder.h).
+ *   --firmware FILE  Also write the first intact firmware dump (CMD_FIRMWARE)
+ *                    as a firmwaredump.h for fakelens built with
+ *                    -DFIRMWARE_DUMP.
+ *
+ * The capture is memory-mapped and split into chunks that are scanned in
+ * parallel for the only events that matter: rising edges on CLK, where the
+ * data line is read, and edges on either ACK line.  Raw captures are
+ * scanned 16 samples at a time with SSE2, where it's available, since most
+ * blocks have nothing in them at all.  The events, which are far fewer than
+ * the samples, are then put together into bytes and transactions in order.
+ *
+ * A byte is 8 rising edges on CLK, LSB first, and any edge on an ACK line
+ * ends it, so a stray clock edge (such as the clock reset after
+ * CMD_CLOCK_RESET) spoils at most one byte.  Transactions are picked out of
+ * the bytes with the command kinds in commands.h, and checked with the same
+ * Frame code that the lens and body use.  Anything that doesn't fit is
+ * skipped a byte at a time until a command with a good checksum turns up.
+ *
+ * The output is, multi-byte fields LSB first:
+ *   "MFTX", version (1)
+ *   Records, each of which is
+ *     length (2)     Bytes in the record from here on
+ *     flags (1)      RECORD_OK, RECORD_SENT and RECORD_UNKNOWN, as in
+ *                    recorder.h
+ *     time (8)       ns from the start of the capture to the first clock edge
+ *     duration (4)   ns from there to the last clock edge
+ *     command (4)    In the order it was sent
+ *     data           Whatever followed, without its length or checksum
+ *   Index: the time (8) and file offset (8) of every DECODE_INDEX_EVERY'th
+ *          record, so that a time can be found without reading everything
+ *   Trailer: record count (8), offset of the index (8), "MFTX"
+ */
+
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "typedef.h"
+#include "common.h"
+#include "commands.h"
+#include "recorder.h"
+
+#define DECODE_VERSION 1
+#define DECODE_INDEX_EVERY 4096
+
+#define CHUNK_BYTES (64UL << 20) // Of the capture, per scanning job
+#define MAX_PAYLOAD 0x1000 // Longer packets are taken to be garbage
+#define REPLAY_MAX_BYTES 0x8000 // fakelens indexes its trace with 16 bits
+#define TICKS_PER_US 2 // For replay records, as in hal.h
+
+enum EventType { EVENT_CLK, EVENT_BODY_ACK, EVENT_LENS_ACK };
+
+/* Something that happened on the bus.  The time is in samples for a raw
+ * capture, or ns for CSV. */
+struct Event
+{
+  uint64 time;
+  uint8 type;
+  uint8 level; // Of DATA for EVENT_CLK, otherwise of the ACK line
+};
+
+struct Byte
+{
+  uint64 start; // ns, at the first and last clock edge
+  uint64 end;
+  uint8 value;
+};
+
+struct Options
+{
+  uint64 rate = 0; // Sample rate of a raw capture, or 0 for CSV
+  uint8 clk = 0;
+  uint8 data = 1;
+  uint8 bodyAck = 2;
+  uint8 lensAck = 3;
+  unsigned threads = 0;
+  const char* replay = NULL;
+  const char* firmware = NULL;
+};
+
+struct Chunk
+{
+  uint64 begin; // Offsets into the capture
+  uint64 end;
+  std::vector<Event> events;
+};
+
+struct Stats
+{
+  uint64 bytes = 0;
+  uint64 transactions = 0;
+  uint64 unknown = 0;
+  uint64 bad = 0; // Packets with a bad checksum or length
+  uint64 skipped = 0; // Bytes that weren't part of any transaction
+  uint64 framing = 0; // Bytes cut short by an ACK edge
+};
+
+/*** Scanning raw captures ***/
+
+static inline void rawEvents(const uint8* s, uint64 i, const Options& o,
+                             std::vector<Event>& out)
+{
+  uint8 cur = s[i];
+  uint8 changed = cur ^ s[i - 1];
+  if(changed & (1 << o.bodyAck)){
+    out.push_back({i, EVENT_BODY_ACK, (uint8)((cur >> o.bodyAck) & 1)});
+  }
+  if(changed & (1 << o.lensAck)){
+    out.push_back({i, EVENT_LENS_ACK, (uint8)((cur >> o.lensAck) & 1)});
+  }
+  if(changed & cur & (1 << o.clk)){
+    out.push_back({i, EVENT_CLK, (uint8)((cur >> o.data) & 1)});
+  }
+}
+
+// Finds the events in samples [begin, end), comparing each with the one before
+static void scanRaw(const uint8* s, Chunk& c, const Options& o)
+{
+  uint8 clk = 1 << o.clk;
+  uint8 ack = (1 << o.bodyAck) | (1 << o.lensAck);
+  uint64 i = c.begin ? c.begin : 1;
+
+#ifdef __SSE2__
+  const __m128i clkMask = _mm_set1_epi8(clk);
+  const __m128i ackMask = _mm_set1_epi8(ack);
+  const __m128i zero = _mm_setzero_si128();
+  for(; i + 16 <= c.end; i += 16){
+    __m128i cur = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i prev = _mm_loadu_si128((const __m128i*)(s + i - 1));
+    __m128i changed = _mm_xor_si128(cur, prev);
+    __m128i rises = _mm_and_si128(_mm_and_si128(changed, cur), clkMask);
+    __m128i found = _mm_or_si128(rises, _mm_and_si128(changed, ackMask));
+    uint32 mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(found, zero)) & 0xffff;
+    while(mask){
+      rawEvents(s, i + __builtin_ctz(mask), o, c.events);
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for(; i < c.end; i++){
+    uint8 changed = s[i] ^ s[i - 1];
+    if((changed & s[i] & clk) || (changed & ack)){
+      rawEvents(s, i, o, c.events);
+    }
+  }
+}
+
+/*** Scanning CSV captures ***/
+
+/* Reads a row of the CSV: a time in seconds, and then 0 or 1 for each
+ * channel.  Returns false for anything else, such as the header.  Leaves p
+ * at the start of the next line either way. */
+static bool parseRow(const char*& p, const char* end, uint64& ns, uint8& bits)
+{
+  const char* line = p;
+  while(p < end && *p != '\n'){
+    p++;
+  }
+  const char* eol = p;
+  if(p < end){
+    p++;
+  }
+
+  // Seconds, to the ns, without going through floating point
+  const char* q = line;
+  uint64 whole = 0;
+  uint64 frac = 0;
+  uint64 scale = 1000000000;
+  bool digits = false;
+  while(q < eol && *q >= '0' && *q <= '9'){
+    whole = whole * 10 + (*q++ - '0');
+    digits = true;
+  }
+  if(q < eol && *q == '.'){
+    q++;
+    while(q < eol && *q >= '0' && *q <= '9'){
+      if(scale > 1){
+        scale /= 10;
+        frac += (*q - '0') * scale;
+      }
+      q++;
+      digits = true;
+    }
+  }
+  if(!digits){
+    return(false);
+  }
+  if(q < eol && (*q == 'e' || *q == 'E')){
+    ns = (uint64)(strtod(line, NULL) * 1e9 + 0.5); // Rare enough to be slow
+    while(q < eol && *q != ','){
+      q++;
+    }
+  }
+  else{
+    ns = whole * 1000000000 + frac;
+  }
+
+  bits = 0;
+  for(uint8 channel = 0; q < eol && *q == ','; channel++){
+    q++;
+    while(q < eol && *q == ' '){
+      q++;
+    }
+    if(q < eol && *q == '1' && channel < 8){
+      bits |= 1 << channel;
+    }
+    while(q < eol && *q != ','){
+      q++;
+    }
+  }
+  return(true);
+}
+
+// Finds the events in the rows of [begin, end), which start on a new line
+static void scanCsv(const char* text, Chunk& c, const Options& o)
+{
+  uint8 clk = 1 << o.clk;
+  uint8 ack = (1 << o.bodyAck) | (1 << o.lensAck);
+  uint64 ns;
+  uint8 bits;
+  uint8 prev = 0;
+  bool havePrev = false;
+
+  // The levels going in are on the last row of the chunk before
+  if(c.begin > 0){
+    const char* p = text + c.begin - 1;
+    while(p > text && p[-1] != '\n'){
+      p--;
+    }
+    havePrev = parseRow(p, text + c.begin, ns, prev);
+  }
+
+  const char* p = text + c.begin;
+  const char* end = text + c.end;
+  while(p < end){
+    if(!parseRow(p, end, ns, bits)){
+      continue;
+    }
+    if(!havePrev){
+      prev = bits;
+      havePrev = true;
+      continue;
+    }
+    uint8 changed = bits ^ prev;
+    if((changed & bits & clk) || (changed & ack)){
+      uint8 s[2] = {prev, bits};
+      size_t before = c.events.size();
+      rawEvents(s, 1, o, c.events);
+      for(size_t i = before; i < c.events.size(); i++){
+        c.events[i].time = ns;
+      }
+    }
+    prev = bits;
+  }
+}
+
+/*** Putting it together ***/
+
+static uint64 nanoseconds(uint64 time, const Options& o)
+{
+  if(!o.rate){
+    return(time);
+  }
+  return(time / o.rate * 1000000000 + time % o.rate * 1000000000 / o.rate);
+}
+
+static void assembleBytes(const std::vector<Chunk>& chunks, const Options& o,
+                          std::vector<Byte>& out, Stats& stats)
+{
+  uint8 bits = 0;
+  uint8 value = 0;
+  uint64 start = 0;
+  for(const Chunk& c : chunks){
+    for(const Event& e : c.events){
+      if(e.type != EVENT_CLK){
+        if(bits){
+          stats.framing++;
+        }
+        bits = 0;
+        continue;
+      }
+      if(bits == 0){
+        start = e.time;
+      }
+      value = (value >> 1) | (e.level << 7);
+      if(++bits == 8){
+        out.push_back({nanoseconds(start, o), nanoseconds(e.time, o), value});
+        bits = 0;
+      }
+    }
+  }
+  stats.bytes = out.size();
+}
+
+// Writes little-endian fields into a buffer
+static uint8* put(uint8* p, uint64 value, uint8 n)
+{
+  for(uint8 i = 0; i < n; i++){
+    *p++ = value >> (8 * i);
+  }
+  return(p);
+}
+
+struct Output
+{
+  FILE* file;
+  uint64 offset;
+  uint64 records;
+  std::vector<uint8> index;
+  FILE* replay;
+  uint32 replayBytes;
+  const char* firmware; // Until it's been written
+  const char* capture;
+};
+
+// Writes a firmware dump out as a header for fakelens
+static void writeFirmware(const char* name, const char* capture, const uint8* data,
+                          uint16 nBytes)
+{
+  FILE* f = fopen(name, "w");
+  if(!f){
+    perror(name);
+    return;
+  }
+  fprintf(f, "/* firmwaredump.h\n * Firmware dump for fakelens -DFIRMWARE_DUMP, decoded from %s.\n */\n\n"
+             "#ifndef FIRMWAREDUMP_H_\n#define FIRMWAREDUMP_H_\n\n#include \"typedef.h\"\n\n"
+             "const uint8 firmwareDump[%u] PROGMEM = {", capture, nBytes);
+  for(uint16 i = 0; i < nBytes; i++){
+    fprintf(f, "%s0x%02x,", i % 12 ? " " : "\n  ", data[i]);
+  }
+  fprintf(f, "\n};\n\n#endif /* FIRMWAREDUMP_H_ */\n");
+  fclose(f);
+}
+
+static void writeRecord(Output& out, uint8 flags, uint64 start, uint64 end,
+                        const uint8* command, const uint8* data, uint16 nBytes)
+{
+  uint8 header[2 + 1 + 8 + 4 + 4];
+  uint8* p = put(header, 1 + 8 + 4 + 4 + nBytes, 2);
+  p = put(p, flags, 1);
+  p = put(p, start, 8);
+  uint64 duration = end - start;
+  p = put(p, duration > 0xffffffff ? 0xffffffff : duration, 4);
+  memcpy(p, command, 4);
+
+  if(out.records % DECODE_INDEX_EVERY == 0){
+    uint8 entry[16];
+    put(put(entry, start, 8), out.offset, 8);
+    out.index.insert(out.index.end(), entry, entry + sizeof(entry));
+  }
+  fwrite(header, 1, sizeof(header), out.file);
+  fwrite(data, 1, nBytes, out.file);
+  out.offset += sizeof(header) + nBytes;
+  out.records++;
+
+  // The same thing in the recorder's layout, as long as there's room
+  uint16 length = RECORD_HEADER + nBytes;
+  if(out.replay && nBytes <= RECORD_MAX_DATA && !(flags & RECORD_UNKNOWN) &&
+     out.replayBytes + length + 1 <= REPLAY_MAX_BYTES){
+    uint8 record[1 + RECORD_HEADER + RECORD_MAX_DATA];
+    uint64 ticks = duration / (1000 / TICKS_PER_US);
+    p = put(record, length, 1);
+    p = put(p, flags, 1);
+    p = put(p, start / 1000, 4);
+    p = put(p, ticks > 0xffff ? 0xffff : ticks, 2);
+    memcpy(p, command, 4);
+    memcpy(p + 4, data, nBytes);
+    for(uint16 i = 0; i <= length; i++){
+      fprintf(out.replay, "%s0x%02x,", i % 12 ? " " : i ? "\n    " : "\n  ", record[i]);
+    }
+    out.replayBytes += length + 1;
+  }
+
+  if(out.firmware && (flags & RECORD_OK) && commandFromBytes(command) == CMD_FIRMWARE){
+    writeFirmware(out.firmware, out.capture, data, nBytes);
+    out.firmware = NULL;
+  }
+}
+
+/* Feeds bytes from b[k] on into a frame until it's complete, and returns
+ * how it ended.  Runs out as FRAME_MORE. */
+static FrameStatus feed(Frame& f, const std::vector<Byte>& b, size_t& k)
+{
+  FrameStatus status = FRAME_MORE;
+  while(status == FRAME_MORE && k < b.size()){
+    status = framePutByte(f, b[k++].value);
+  }
+  return(status);
+}
+
+static void decodeTransactions(const std::vector<Byte>& b, Output& out, Stats& stats)
+{
+  static uint8 payload[MAX_PAYLOAD];
+  size_t i = 0;
+  while(i + 5 <= b.size()){
+    uint8 command[4];
+    Frame f;
+    frameBeginCommand(f, command);
+    size_t k = i;
+    if(feed(f, b, k) != FRAME_OK){
+      stats.skipped++;
+      i++;
+      continue;
+    }
+
+    CommandKind kind = commandKind(commandFromBytes(command));
+    uint8 flags = RECORD_OK;
+    uint16 nBytes = 0;
+
+    if(kind == KIND_UNKNOWN){
+      flags |= RECORD_UNKNOWN;
+      stats.unknown++;
+    }
+    else if(kind == KIND_BYTE){
+      if(k < b.size()){
+        payload[nBytes++] = b[k++].value;
+      }
+    }
+    else if(kind != KIND_NONE){
+      size_t commandEnd = k;
+      frameBeginReceive(f, payload, sizeof(payload));
+      FrameStatus status = feed(f, b, k);
+      if(status == FRAME_MORE){
+        break; // The capture ends partway through
+      }
+      if(status == FRAME_TOO_LONG){
+        flags &= ~RECORD_OK; // Whatever follows isn't this packet
+        k = commandEnd;
+        stats.bad++;
+      }
+      else{
+        nBytes = framePayloadBytes(f);
+        if(status != FRAME_OK){
+          flags &= ~RECORD_OK;
+          stats.bad++;
+        }
+      }
+      if(kind == KIND_PACKET){
+        flags |= RECORD_SENT;
+      }
+    }
+
+    writeRecord(out, flags, b[i].start, b[k - 1].end, command, payload, nBytes);
+    stats.transactions++;
+    i = k;
+  }
+  stats.skipped += b.size() - i;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: decode [--raw RATE] [--clk N] [--data N] [--body-ack N] "
+                  "[--lens-ack N] [--threads N] [--replay FILE] [--firmware FILE] capture out.mftx\n");
+  exit(2);
+}
+
+static double seconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+int main(int argc, char** argv)
+{
+  Options o;
+  int arg = 1;
+  for(; arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-'; arg += 2){
+    if(arg + 1 >= argc){
+      usage();
+    }
+    const char* name = argv[arg] + 2;
+    const char* value = argv[arg + 1];
+    if(!strcmp(name, "raw")){ o.rate = strtoull(value, NULL, 10); }
+    else if(!strcmp(name, "clk")){ o.clk = atoi(value); }
+    else if(!strcmp(name, "data")){ o.data = atoi(value); }
+    else if(!strcmp(name, "body-ack")){ o.bodyAck = atoi(value); }
+    else if(!strcmp(name, "lens-ack")){ o.lensAck = atoi(value); }
+    else if(!strcmp(name, "threads")){ o.threads = atoi(value); }
+    else if(!strcmp(name, "replay")){ o.replay = value; }
+    else if(!strcmp(name, "firmware")){ o.firmware = value; }
+    else{ usage(); }
+  }
+  if(argc - arg != 2 || o.clk > 7 || o.data > 7 || o.bodyAck > 7 || o.lensAck > 7){
+    usage();
+  }
+  if(!o.threads){
+    o.threads = std::thread::hardware_concurrency();
+    o.threads = o.threads ? o.threads : 1;
+  }
+
+  int fd = open(argv[arg], O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0){
+    perror(argv[arg]);
+    return(1);
+  }
+  uint64 size = st.st_size;
+  const char* capture = (const char*)mmap(NULL, size ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(capture == MAP_FAILED){
+    perror("mmap");
+    return(1);
+  }
+  madvise((void*)capture, size, MADV_SEQUENTIAL);
+
+  double start = seconds();
+
+  // Chunks of a CSV start on a new line
+  std::vector<Chunk> chunks;
+  for(uint64 begin = 0; begin < size;){
+    uint64 end = begin + CHUNK_BYTES < size ? begin + CHUNK_BYTES : size;
+    if(!o.rate){
+      while(end < size && capture[end - 1] != '\n'){
+        end++;
+      }
+    }
+    chunks.push_back({begin, end, {}});
+    begin = end;
+  }
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for(unsigned t = 0; t < o.threads; t++){
+    workers.emplace_back([&](){
+      for(size_t i; (i = next++) < chunks.size();){
+        if(o.rate){
+          scanRaw((const uint8*)capture, chunks[i], o);
+        }
+        else{
+          scanCsv(capture, chunks[i], o);
+        }
+      }
+    });
+  }
+  for(std::thread& w : workers){
+    w.join();
+  }
+  double scanned = seconds();
+
+  Stats stats;
+  std::vector<Byte> bytes;
+  assembleBytes(chunks, o, bytes, stats);
+  chunks.clear();
+
+  Output out = {fopen(argv[arg + 1], "wb"), 0, 0, {}, NULL, 0, o.firmware, argv[arg]};
+  if(!out.file){
+    perror(argv[arg + 1]);
+    return(1);
+  }
+  static char buffer[1 << 20];
+  setvbuf(out.file, buffer, _IOFBF, sizeof(buffer));
+  const uint8 magic[5] = {'M', 'F', 'T', 'X', DECODE_VERSION};
+  fwrite(magic, 1, sizeof(magic), out.file);
+  out.offset = sizeof(magic);
+
+  if(o.replay){
+    out.replay = fopen(o.replay, "w");
+    if(!out.replay){
+      perror(o.replay);
+      return(1);
+    }
+    fprintf(out.replay, "/* replaytrace.h\n * Trace for fakelens -DREPLAY, decoded from %s.\n */\n\n"
+                        "#ifndef REPLAYTRACE_H_\n#define REPLAYTRACE_H_\n\n#include \"typedef.h\"\n\n"
+                        "const uint8 replayTrace[] PROGMEM = {", argv[arg]);
+  }
+
+  decodeTransactions(bytes, out, stats);
+
+  uint64 indexOffset = out.offset;
+  fwrite(out.index.data(), 1, out.index.size(), out.file);
+  uint8 trailer[20];
+  memcpy(put(put(trailer, out.records, 8), indexOffset, 8), "MFTX", 4);
+  fwrite(trailer, 1, sizeof(trailer), out.file);
+  if(fclose(out.file) != 0){
+    perror(argv[arg + 1]);
+    return(1);
+  }
+  if(out.firmware){
+    fprintf(stderr, "No intact firmware dump in the capture\n");
+  }
+  if(out.replay){
+    fprintf(out.replay, "\n};\n\n#endif /* REPLAYTRACE_H_ */\n");
+    fclose(out.replay);
+  }
+
+  double done = seconds();
+  fprintf(stderr, "%.1f MB scanned in %.3f s (%.0f MB/s) on %u threads, decoded in %.3f s\n",
+          size / 1e6, scanned - start, size / 1e6 / (scanned - start), o.threads, done - scanned);
+  fprintf(stderr, "%llu bytes, %llu transactions (%llu unknown, %llu bad packets), "
+                  "%llu bytes skipped, %llu bytes cut short\n",
+          (unsigned long long)stats.bytes, (unsigned long long)stats.transactions,
+          (unsigned long long)stats.unknown, (unsigned long long)stats.bad,
+          (unsigned long long)stats.skipped, (unsigned long long)stats.framing);
+  return(0);
+}
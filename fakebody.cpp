@@ -4,16 +4,152 @@
  * August 2012
  */
 
-#include "Arduino.h"
+#include <string.h>
 #include "typedef.h"
 #include "common.h"
+#include "hal.h"
+#include "profile.h"
+#include "telemetry.h"
+#include "standby.h"
+#include "cadence.h"
+#include "control.h"
+#include "lensrecord.h"
+#include "recorder.h"
+#include "commands.h"
+#include "memory.h"
+#include "body.h"
+#include "focus.h"
+#include "zoomtrack.h"
+
+// Set to true to use the SPI hardware rather than bit-banging.  Either way
+// the lens sees the same waveform, just with different timing.  A lens
+// with a measured timing profile (see characterize()) gets its own clock
+// once it has been identified.
+#define USE_HARDWARE_SPI true
+#define SPI_CLOCK SPI_CLOCK_DIV8 // 2 MHz
+
+// Number of standby packets timed with each transport by throughputTest()
+#define THROUGHPUT_PACKETS 200
+
+// Firmware dumps that firmwareTest() reads
+#define FIRMWARE_ROUNDS 5
+
+// Rounds of lens info and standby queries that characterize() runs at each
+// setting, all of which have to come back intact
+#define CHARACTERIZE_ROUNDS 100
+
+// Set to true to stream every standby response out of TX1 (see telemetry.h)
+#define STANDBY_TELEMETRY true
+
+// The camera body to play, from body.h.  Build with -DBODY=BODY_EP1 and so
+// on to play another.
+#ifndef BODY
+#define BODY BODY_EPL1
+#endif
+
+// Frames per second: 30, 60, 120 or 240
+#define FRAME_RATE 60
+
+// Payload bytes of the extended packets we know about
+#define EXTENDED_PAYLOAD_BYTES 9
+
+// Time to allow for an extended packet, including the old fixed delays
+#define EXTENDED_PACKET_US 1000
+
+// Set to true to pace the handshake by LENS_ACK alone, rather than the
+// fixed delays we started out with.
+#define EDGE_HANDSHAKE true
+
+// Set to true to skip C1 F9 at power-up for a lens whose description is
+// already in EEPROM.  It only saves the query and the gap after it, about
+// 1.4 ms of the ~545 ms to the first standby packet, most of which is the
+// lens' own pause after CMD_INIT; so by default every lens is asked, as the
+// camera does.
+#define SKIP_KNOWN_LENS_INFO false
+
+// Everything that depends on the body is a constant from here on
+constexpr BodyProfile body = bodyProfiles[BODY];
+static_assert(body.standbyBytes <= STANDBY_BYTES, "Standby buffers are too small for this body");
+
+bool hardwareSpi = false; // Which transport writeByte() and readByte() use
+uint8 spiClock = SPI_CLOCK;
+bool edgeHandshake = EDGE_HANDSHAKE;
+bool standbyTelemetry = STANDBY_TELEMETRY;
+
+/* Steps of the handshake that can be given a minimum setup time, on top of
+ * waiting for the lens.  They default to zero, which is as fast as the lens
+ * will go; these are here to find out how much margin a real lens needs. */
+enum HandshakeStep {
+  STEP_BYTE, // From the lens being ready to clocking the next byte
+  STEP_TURNAROUND, // From the end of an extended command to handing over the data line
+  STEP_PACKET, // From the checksum of an extended command to its packet
+  STEP_RELEASE, // From the end of an extended packet to dropping BODY_ACK
+  STEP_COMMAND, // Between commands during power-up, if longer than the body's gap
+  HANDSHAKE_STEPS
+};
+
+uint16 setupUs[HANDSHAKE_STEPS] = {0, 0, 0, 0, 0};
+
+/* Build with -DHANDSHAKE_REPORT to keep track of how long the bus spends
+ * waiting (on the lens or on delays) against actually clocking bytes.  This
+ * uses the tick timer rather than micros(), which takes long enough to miss
+ * an ACK pulse. */
+#ifdef HANDSHAKE_REPORT
+uint32 waitingTicks = 0;
+uint32 transferTicks = 0;
+#define TIMED(total, code) do{ uint16 start = ticks(); code; total##Ticks += (uint16)(ticks() - start); }while(0)
+#else
+#define TIMED(total, code) do{ code; }while(0)
+#endif
+
+/* Every wait on the lens gives up once its budget runs out, so that a missed
+ * edge costs a frame rather than hanging the camera.  After one wait has
+ * timed out, the rest fall straight through to the end of the transaction,
+ * and busRecover() has to put the bus back in order before the next one.
+ * The budget is counted in whole periods of the tick timer, since a single
+ * 16-bit count only covers 32 ms. */
+#define WAIT_PERIOD_TICKS (1000 * TICKS_PER_US) // 1 ms
+#define WAIT_BUDGET_MS 1 // Within a frame, where the lens answers in tens of us
+#define POWERUP_BUDGET_MS 1000 // Power-up has a 500 ms pause in the handshake
+
+uint16 waitBudgetMs = WAIT_BUDGET_MS;
+bool busTimedOut = false;
+
+/* Ways of getting the bus back after a timeout, gentlest first.  See
+ * busRecover(). */
+enum Recovery {
+  RECOVER_RESYNC, // Let go of the bus and drop the clock until the lens gives up
+  RECOVER_POWER_CYCLE, // Turn the lens off and go through power-up again
+  RECOVERIES
+};
+
+// Longer than the lens waits on a half-finished transaction (see fakelens)
+#define RESYNC_US 3000
+
+// Resyncs in a row, without a good standby packet in between, before we
+// power cycle the lens instead
+#define RESYNC_TRIES 3
+
+struct RecoveryStats
+{
+  uint16 count;
+  uint32 lastUs; // Time taken by the most recent one
+  uint32 maxUs;
+};
+
+RecoveryStats recoveries[RECOVERIES];
+uint8 resyncsInARow = 0;
 
-// Number of bytes in a standby response packet
-#define STANDBY_RESPONSE_BYTES 31
+LensRecord lens; // What we know about the lens, from power-up
+bool lensCached = false; // True if the record came from EEPROM
+uint32 firstStandbyUs; // From power on to the first standby packet
 
 /* Performs one-time pin initialization and other setup */
 void setup() {
   Serial.begin(115200);
+  telemetryBegin();
+  controlBegin();
+  digitalWrite(CLK, HIGH); // Idle high, without a glitch when it becomes an output
   pinMode(SLEEP, OUTPUT);
   pinMode(BODY_ACK, OUTPUT);
   pinMode(LENS_ACK, INPUT);
@@ -22,244 +158,452 @@ void setup() {
   pinMode(DATA_MOSI, INPUT); // We're only using MISO, but they're tied together.
   pinMode(FOCUS, OUTPUT);
   pinMode(SHUTTER, OUTPUT);
+  pinMode(SPI_SS, OUTPUT); // Otherwise the SPI hardware can't be a master
 
   digitalWrite(SLEEP, LOW);
   digitalWrite(BODY_ACK, LOW);
   digitalWrite(CLK, HIGH);
 }
 
-/* Writes a single byte on the SPI bus at about 500 kHz, and waits for the
- * camera acknowledgment.
- * The clock and data pins are set to be outputs
- * The data is written LSB-first. */
-void writeByte(uint8 value)
+/* Switches writeByte() and readByte() between bit-banging and the SPI
+ * hardware.  The SPI master sends on MOSI and receives on MISO, which works
+ * because they are tied together; we just have to make sure only one of them
+ * is ever driving the line. */
+void useHardwareSpi(bool enable)
 {
-  DATA_DIR |= DATA_WRITE; // Just in case...
-  DATA_DIR |= CLK_WRITE;
-  // Data is set on the falling edge, and the lens reads it on the rising edge
-  for(uint8 i = 0; i < 8; i++){
-    CLK_PORT &= CLK_LOW; // Set the clock pin low
-    if(value & 0x01){ // Set the data pin to the bit value
-      DATA_PORT |= DATA_HIGH;
-    }
-    else{
-      DATA_PORT &= DATA_LOW;
-    }
-    CLK_PORT |= CLK_HIGH; // Set the clock pin high
-    value = value >> 1; // Shift down to the next bit
+  hardwareSpi = enable;
+  if(enable){
+    pinMode(DATA_MISO, INPUT);
+    spiMasterEnable(spiClock);
+  }
+  else{
+    spiDisable(); // CLK goes back to its port value, which is high
+    releaseMosi();
   }
-  // Wait for the ACK
-  delayMicroseconds(15);
 }
 
-/* Reads a single byte from the SPI bus.
- * Data is read LSB-first
- */
-unsigned char readByte()
+/* Sets the hardware SPI clock and the setup time before each byte, which is
+ * all there is to a lens' timing profile. */
+void useTiming(uint8 clock, uint8 byteSetupUs)
 {
-  unsigned char value = 0;
-  for(int i = 0; i < 8; i++){
-    CLK_PORT &= CLK_LOW;
-    value = value >> 1;
-    CLK_PORT |= CLK_HIGH;
-    if(DATA_PIN & DATA_HIGH){
-      value |= 0x80;
+  spiClock = clock;
+  setupUs[STEP_BYTE] = byteSetupUs;
+  if(hardwareSpi){
+    spiMasterEnable(spiClock);
+  }
+}
+
+/* Relinquishes control of the data line so that the lens can drive it */
+inline void releaseDataLine()
+{
+  if(hardwareSpi){
+    releaseMosi();
+  }
+  else{
+    pinMode(DATA, INPUT);
+  }
+}
+
+/* Waits until the lens ACK pin is at the given level, or the wait budget
+ * runs out.  The timer is only compared against the start of the current
+ * period, which keeps the loop tight enough to catch a 2 us ACK pulse. */
+void waitLensLevel(bool high)
+{
+  if(busTimedOut){
+    return;
+  }
+  uint16 start = ticks();
+  uint16 periods = waitBudgetMs;
+  while(lensAckHigh() != high){
+    if((uint16)(ticks() - start) >= WAIT_PERIOD_TICKS){
+      if(--periods == 0){
+        busTimedOut = true;
+        return;
+      }
+      start += WAIT_PERIOD_TICKS;
     }
   }
-  return(value);
 }
 
 // Wait for a falling edge on the lens ACK pin
 inline void waitLensFall()
 {
-  while(!(LENS_ACK_PIN & LENS_ACK_HIGH)){} // Wait until it's high first
-  while(LENS_ACK_PIN & LENS_ACK_HIGH){}
+  TIMED(waiting, waitLensLevel(HIGH); waitLensLevel(LOW));
 }
 
+/* Once LENS_ACK is high, the lens is ready and waiting for us, so there's
+ * no pulse to miss.  Interrupts held off for a transaction (see
+ * standbyPacket()) get to run then. */
+
 // Wait for a rising edge on the lens ACK pin
 inline void waitLensRise()
 {
-  while(LENS_ACK_PIN & LENS_ACK_HIGH){} // Wait until it's low first
-  while(!(LENS_ACK_PIN & LENS_ACK_HIGH)){}
+  TIMED(waiting, waitLensLevel(LOW); waitLensLevel(HIGH));
+  interruptWindow();
 }
 
 // Wait until the lens ACK pin is high
 inline void waitLensHigh()
 {
-  while(!(LENS_ACK_PIN & LENS_ACK_HIGH)){}
+  TIMED(waiting, waitLensLevel(HIGH));
+  interruptWindow();
 }
 
 // Wait until the lens ACK pin is low
 inline void waitLensLow()
 {
-  while((LENS_ACK_PIN & LENS_ACK_HIGH)){}
+  TIMED(waiting, waitLensLevel(LOW));
+}
+
+inline void pause(uint16 us)
+{
+  TIMED(waiting, delayMicroseconds(us));
+}
+
+// Hold off for the minimum setup time of a step, if it has one
+inline void waitSetup(HandshakeStep step)
+{
+  if(setupUs[step]){
+    pause(setupUs[step]);
+  }
+}
+
+/* Finishes a step of the handshake: its setup time if we're going by the
+ * edges on LENS_ACK, or the old fixed delay if not. */
+inline void settle(HandshakeStep step, uint16 fixedUs)
+{
+  if(edgeHandshake){
+    waitSetup(step);
+  }
+  else{
+    pause(fixedUs);
+  }
+}
+
+/* Spaces out the commands during power-up by the body's gap (see body.h),
+ * whichever handshake we're using, or by STEP_COMMAND's setup time if
+ * that's longer. */
+inline void commandGap()
+{
+  uint16 us = setupUs[STEP_COMMAND];
+  pause(us > body.commandGapUs ? us : body.commandGapUs);
+}
+
+/* Waits for the lens to take the byte we just finished with, which it shows
+ * by dropping LENS_ACK.  The pulse is short, but we start looking right away
+ * and the lens can't react any faster than its interrupt latency. */
+inline void waitLensTook(uint16 fixedUs)
+{
+  if(edgeHandshake){
+    waitLensLow();
+  }
+  else{
+    pause(fixedUs);
+  }
+}
+
+/* Clocks a byte out, LSB-first.  The clock and data pins are set to be
+ * outputs. */
+void clockOut(uint8 value)
+{
+  if(hardwareSpi){
+    driveMosi();
+    spiWrite(value);
+    while(!spiDone()){}
+    return;
+  }
+
+  driveData(); // Just in case...
+  driveClk();
+  // Data is set on the falling edge, and the lens reads it on the rising edge
+  for(uint8 i = 0; i < 8; i++){
+    setClk(LOW); // Set the clock pin low
+    setData(value & 0x01); // Set the data pin to the bit value
+    setClk(HIGH); // Set the clock pin high
+    value = value >> 1; // Shift down to the next bit
+  }
+}
+
+/* Clocks a byte in, LSB-first */
+uint8 clockIn()
+{
+  if(hardwareSpi){
+    // The master has to send something to run the clock, but with MOSI as an
+    // input it never reaches the line.
+    spiWrite(0xFF);
+    while(!spiDone()){}
+    return(spiRead());
+  }
+
+  uint8 value = 0;
+  for(uint8 i = 0; i < 8; i++){
+    setClk(LOW);
+    value = value >> 1;
+    setClk(HIGH);
+    if(dataHigh()){
+      value |= 0x80;
+    }
+  }
+  return(value);
+}
+
+/* Writes a single byte on the SPI bus, and waits for the lens to
+ * acknowledge it.  With the edge handshake, this also waits for the lens to
+ * be ready beforehand. */
+void writeByte(uint8 value)
+{
+  if(edgeHandshake){
+    waitLensHigh();
+    waitSetup(STEP_BYTE);
+  }
+  TIMED(transfer, clockOut(value));
+  waitLensTook(15);
+}
+
+/* Reads a single byte from the SPI bus.
+ * Data is read LSB-first
+ */
+uint8 readByte()
+{
+  uint8 value;
+  TIMED(transfer, value = clockIn());
+  return(value);
 }
 
 /* Sends a 4-byte command and waits for the checksum
  * Returns true if the checksum matches, false otherwise.
  * The BODY_ACK pin should be low when this method enters.
- * The BODY_ACK pin is low when this method exits. */
-bool sendCommand(uint8* bytes)
+ * The BODY_ACK and LENS_ACK pins are both low when this method exits. */
+bool sendCommand(uint32 command)
 {
-  uint8 checksum = 0; // Our running checksum
-  uint8 checkbyte; // Checksum from the lens
-
-  digitalWrite(BODY_ACK, HIGH); // Get the lens' attention
+  uint8 bytes[4];
+  commandToBytes(command, bytes);
+  Frame f;
+  frameBeginCommand(f, bytes);
+
+  waitLensLow(); // Make sure the lens has finished with the last transaction
+  profileStart();
+  setBodyAck(HIGH); // Get the lens' attention
   waitLensHigh(); // Wait for it to be ready
 
   // Send the four bytes
-  for(uint8 i = 0; i < 4; i++){
-    writeByte(bytes[i]);
-    checksum += bytes[i];
+  while(!frameAtChecksum(f)){
+    writeByte(frameNextByte(f));
   }
+  profileMark(PHASE_COMMAND);
 
-  pinMode(DATA, INPUT); // Relinquish control of the data pin
+  releaseDataLine(); // Relinquish control of the data pin
 
   waitLensLow();
-  digitalWrite(BODY_ACK, LOW);
+  setBodyAck(LOW);
   waitLensHigh();
-  digitalWrite(BODY_ACK, HIGH); // Tell the lens we're ready
+  setBodyAck(HIGH); // Tell the lens we're ready
 
-  checkbyte = readByte();
+  FrameStatus status = framePutByte(f, readByte());
 
-  digitalWrite(BODY_ACK, LOW);
+  setBodyAck(LOW);
+  // Wait for the lens to acknowledge, otherwise whatever follows may mistake
+  // its ACK from the checksum for the start of the response.
+  waitLensLow();
+  profileMark(PHASE_CHECKSUM);
 
-  return(checksum == checkbyte);
+  return(status == FRAME_OK);
 }
 
-/* Reads a series of bytes in response to a command
- * bytes - Pointer to store the byte values in.
- * maxBytes - Maximum number of bytes to read, not including header.
- * Returns true if expected number of bytes is read, false otherwise. */
-uint16 readBytes(uint8* bytes, uint16 maxBytes)
+/* Reads a packet in response to a command
+ * bytes - Pointer to store the payload in.
+ * maxBytes - Maximum number of payload bytes to read.
+ * keepFirst - Read a longer packet all the same, but only keep the first
+ *             maxBytes of it.
+ * Returns the number of payload bytes read, or 0 if the packet was too long
+ * or the checksum didn't match. */
+uint16 readBytes(uint8* bytes, uint16 maxBytes, bool keepFirst = false)
 {
-  // Read the packet length
-  uint16 nBytes;
+  Frame f;
+  FrameStatus status;
+  if(keepFirst){
+    frameBeginWatch(f, bytes, maxBytes);
+  }
+  else{
+    frameBeginReceive(f, bytes, maxBytes);
+  }
 
+  // Read the packet length
   waitLensHigh();
-  digitalWrite(BODY_ACK, HIGH);
-  nBytes = readByte(); // Low 8 bits
-  BODY_ACK_PORT &= BODY_ACK_LOW;
+  setBodyAck(HIGH);
+  framePutByte(f, readByte()); // Low 8 bits
+  setBodyAck(LOW);
 
-  delayMicroseconds(10);
+  waitLensTook(10);
   waitLensHigh();
 
-  digitalWrite(BODY_ACK, HIGH);
-  nBytes += (uint16)readByte() << 8; // High 8 bits
-  digitalWrite(BODY_ACK, LOW);
+  setBodyAck(HIGH);
+  status = framePutByte(f, readByte()); // High 8 bits
+  setBodyAck(LOW);
 
   waitLensLow(); // Just to be safe
+  profileMark(PHASE_LENGTH);
 
   // If the lens is trying to give us more bytes than we have storage for, fail.
-  if(nBytes > maxBytes){
+  if(status == FRAME_TOO_LONG){
     return(0);
   }
 
-  for(uint16 i = 0; i < nBytes; i++){
+  // Payload and checksum, which is checked as it arrives
+  while(status == FRAME_MORE){
     waitLensHigh();
-    digitalWrite(BODY_ACK, HIGH);
-    bytes[i] = readByte();
-    //BODY_ACK_PORT &= BODY_ACK_LOW; // Set low; digitalWrite is too slow here.
-    digitalWrite(BODY_ACK, LOW);
-    // BUG: something isn't working with waitLensLow.
-    //waitLensLow();
-    delayMicroseconds(10);
+    waitSetup(STEP_BYTE);
+    setBodyAck(HIGH);
+    status = framePutByte(f, readByte());
+    setBodyAck(LOW);
+    waitLensTook(10);
   }
+  profileMark(PHASE_PAYLOAD);
 
+  return(status == FRAME_OK ? framePayloadBytes(f) : 0);
+}
+
+// Flags for the recorder, from how a transaction went
+inline uint8 recordFlags(bool ok)
+{
+  return(busTimedOut ? RECORD_TIMEOUT : ok ? RECORD_OK : 0);
+}
+
+/* Sends a command and reads the packet that comes back, as readBytes()
+ * does, and records the whole transaction. */
+uint16 query(uint32 command, uint8* response, uint16 maxBytes)
+{
+  uint32 startUs = micros();
+  uint16 start = ticks();
+  bool ok = sendCommand(command);
+  uint16 nBytes = readBytes(response, maxBytes);
+  uint8 bytes[4];
+  commandToBytes(command, bytes);
+  recordTransaction(bytes, recordFlags(ok && nBytes), startUs,
+                    ticks() - start, response, nBytes);
   return(nBytes);
 }
 
+// The packet after CMD_SETUP (60 F0 00 00).  Old lenses had different
+// commands; not sure what these are.
+const uint8 setupPacket[4] PROGMEM = {0x00, 0x00, 0x00, 0x00};
+
+/* Turns the lens on and takes it through the same start-up as the camera.
+ * A lens we've seen before gets its timing profile and zoom table from
+ * EEPROM, and with SKIP_KNOWN_LENS_INFO isn't asked to describe itself
+ * again.  Otherwise its description is read and saved at the end, once the
+ * bus is quiet. */
 void powerup() {
-  uint8 bytedump[50]; // Array for dumping bytes read from the lens
+  uint8 bytedump[STANDBY_BYTES]; // The longest response during power-up
+  uint32 start = micros();
+  waitBudgetMs = POWERUP_BUDGET_MS;
+  useTiming(SPI_CLOCK, 0); // Until we know which lens it is
 
   // Powerup
   digitalWrite(SLEEP, HIGH);
-  delay(10);
+  delay(body.wakeMs);
   digitalWrite(BODY_ACK, HIGH);
 
   waitLensFall();
   digitalWrite(BODY_ACK, LOW);
 
-  delay(20);
+  delay(body.firstCommandMs);
 
-  // Now start some data transfer
-  uint8 c1[4] = {0xB0, 0xF2, 0x00, 0x00};
-  sendCommand(c1);
+  // Now start some data transfer.  Each transaction runs with interrupts
+  // off, as in standbyPacket(), since a missed pulse here costs the whole
+  // power-up budget.
+  noInterrupts();
+  sendCommand(CMD_INIT);
+  interrupts();
 
-  // There seems to be an extra low-high here, not sure why
+  // There seems to be an extra low-high here, not sure why.  The lens holds
+  // LENS_ACK high through its 500 ms pause, which is far too long to go
+  // without interrupts, and then holds it low until we answer, so there's
+  // no pulse to miss until then.
   waitLensLow();
   digitalWrite(BODY_ACK, HIGH);
   waitLensFall(); // Wait for rise and fall
+  noInterrupts();
   digitalWrite(BODY_ACK, LOW);
+  waitLensHigh();
   digitalWrite(BODY_ACK, HIGH);
 
   readByte(); // Should be 0x00?
   digitalWrite(BODY_ACK, LOW); // Tell the lens we're working
-
-  delay(1);
-
-  uint8 c2[4] = {0xC0, 0xF6, 0x00, 0x00};
-  sendCommand(c2);
-  readBytes(bytedump, 5);
+  interrupts();
+
+  commandGap();
+
+  // The lens' identity, which tells us whether we know the rest already
+  noInterrupts();
+  bool idRead = (query(CMD_LENS_ID, bytedump, sizeof(bytedump)) == LENS_ID_BYTES);
+  interrupts();
+  memcpy(lens.id, bytedump, LENS_ID_BYTES);
+  lensCached = idRead && lensRecordLoad(lens.id, lens);
+  if(!lensCached){
+    lens.timing.spiClock = LENS_TIMING_NONE;
+    lens.zoom.calibrated = false;
+  }
 
 
-  delay(1);
+  commandGap();
 
-  uint8 c3[4] = {0xA0, 0xF5, 0x01, 0x00};
-  sendCommand(c3);
+  noInterrupts();
+  sendCommand(CMD_CLOCK_RESET);
+  interrupts();
 
   // This is where the camera does a clock reset.  Is that important?
-  delay(1);
-
-  uint8 c4[4] = {0xC1, 0xF9, 0x00, 0x00};
-  sendCommand(c4);
-
-  readBytes(bytedump, 0x15); // Read 21 bytes
-
-  delay(1);
+  commandGap();
+
+  bool infoRead = false;
+  if(!lensCached || !SKIP_KNOWN_LENS_INFO){
+    noInterrupts();
+    infoRead = (query(CMD_LENS_INFO, bytedump, sizeof(bytedump)) == LENS_INFO_BYTES);
+    interrupts();
+    memcpy(lens.info, bytedump, LENS_INFO_BYTES);
+    commandGap();
+  }
 
-  uint8 c5[4] = {0x60, 0xF0, 0x00, 0x00};
-  sendCommand(c5);
+  noInterrupts();
+  sendCommand(CMD_SETUP);
 
   digitalWrite(BODY_ACK, HIGH);
   waitLensHigh();
-  // Old lens had different commands; not sure what these are.
-  writeByte(0x05);
-  writeByte(0x00);
-  writeByte(0x00);
-  writeByte(0x00);
-  writeByte(0x00);
-  writeByte(0x00);
+  Frame f;
+  frameBeginSend_P(f, setupPacket, sizeof(setupPacket));
+  while(!frameAtChecksum(f)){
+    writeByte(frameNextByte(f));
+  }
 
-  // Read one byte
-  pinMode(DATA, INPUT);
+  // Read the checksum
+  releaseDataLine();
   digitalWrite(BODY_ACK, LOW);
   waitLensRise();
   digitalWrite(BODY_ACK, HIGH);
-  readByte();
+  framePutByte(f, readByte());
   digitalWrite(BODY_ACK, LOW);
 
   // Standby packet
-  uint8 c6[4] = {0xC1, 0x80, 0x01, 0x06};
-  sendCommand(c6);
-  readBytes(bytedump, 0x1F); // Read 31 bytes
+  query(body.standby, bytedump, body.standbyBytes);
+  interrupts();
+  firstStandbyUs = micros() - start;
 
-  delay(1);
+  commandGap();
 
   // Manual focus
-  uint8 c7[4] = {0xA0, 0xB0, 0xFE, 0x00}; // Ring forward
-  //uint8 c7[4] = {0xA0, 0xB0, 0xFE, 0x01}; // Ring reverse
-  sendCommand(c7);
+  noInterrupts();
+  sendCommand(CMD_MANUAL_FOCUS); // Ring forward
+  interrupts();
 
-  delay(1);
+  commandGap();
 
-  uint8 c8[4] = {0xB1, 0x88, 0x03, 0x02};
-  sendCommand(c8);
+  noInterrupts();
+  sendCommand(CMD_FOCUS_SETUP);
   // There's something funny here - an extra handshake on the ACK lines, and then a single byte
   // Assume at this point that our ACK line is low
   waitLensLow();
   digitalWrite(BODY_ACK, HIGH);
-  // Lens goes high and then low again
+  // Lens goes high and then low again, this time with only a pulse between
   waitLensFall();
   digitalWrite(BODY_ACK, LOW);
   waitLensHigh();
@@ -268,167 +612,744 @@ void powerup() {
 
 
   digitalWrite(BODY_ACK, LOW); // Clean up after ourselves
-  delay(1);
+  interrupts();
+  commandGap();
+  waitBudgetMs = WAIT_BUDGET_MS;
+
+  if(idRead && infoRead && !busTimedOut){
+    lensRecordStore(lens);
+  }
+  if(lens.timing.spiClock != LENS_TIMING_NONE){
+    useTiming(lens.timing.spiClock, lens.timing.byteSetupUs);
+  }
+  zoomTrackStart();
+}
+
+// Prints which lens is attached, and how long it took to start up
+void lensReport()
+{
+  char serial[LENS_INFO_SERIAL_BYTES + 1];
+  lensSerial(lens, serial);
+  Serial.print(F("Lens "));
+  for(uint8 i = 0; i < LENS_ID_BYTES; i++){
+    if(lens.id[i] < 0x10){
+      Serial.print('0');
+    }
+    Serial.print(lens.id[i], HEX);
+  }
+  Serial.print(F(", serial "));
+  Serial.print(serial);
+  Serial.print(F(", firmware "));
+  Serial.print(lensFirmware(lens), HEX);
+  Serial.print(lensCached ? F(" (from EEPROM)") : F(" (from the lens)"));
+  Serial.print(F(": "));
+  Serial.print(firstStandbyUs);
+  Serial.println(F(" us to the first standby packet"));
+  if(lens.timing.spiClock != LENS_TIMING_NONE){
+    Serial.print(F("Timing profile: SPI at "));
+    Serial.print(spiClockKhz(lens.timing.spiClock));
+    Serial.print(F(" kHz, "));
+    Serial.print(lens.timing.byteSetupUs);
+    Serial.println(F(" us before each byte"));
+  }
+}
+
+/* Lets go of the bus and holds the clock low for RESYNC_US, like the clock
+ * reset the camera does after A0 F5 01 00.  That's long enough for the lens
+ * to give up on whatever it was in the middle of, and any partial byte in
+ * its SPI hardware goes with it.  Returns true if the lens ended up idle. */
+bool resync()
+{
+  setBodyAck(LOW);
+  releaseDataLine();
+  if(hardwareSpi){
+    spiDisable();
+  }
+  setClk(LOW);
+  pause(RESYNC_US);
+  setClk(HIGH);
+  if(hardwareSpi){
+    spiMasterEnable(spiClock);
+  }
+  return(!lensAckHigh());
+}
+
+/* Turns the lens off and back on, and runs the power-up sequence again.
+ * This takes over half a second, most of it the lens' own pause in the
+ * first handshake. */
+void powerCycle()
+{
+  digitalWrite(SLEEP, LOW);
+  setBodyAck(LOW);
+  delay(10);
+  powerup();
+}
+
+/* Puts the bus back in a known state after a wait timed out: both ACK lines
+ * low and the lens waiting for a command.  A resync is tried first, and if
+ * that doesn't work (or hasn't been working), the lens is power cycled.  If
+ * even that times out, busTimedOut stays set and the next frame tries
+ * again. */
+void busRecover()
+{
+  uint32 start = micros();
+  busTimedOut = false;
+
+  Recovery r = RECOVER_RESYNC;
+  if(!resync() || ++resyncsInARow > RESYNC_TRIES){
+    r = RECOVER_POWER_CYCLE;
+    resyncsInARow = 0;
+    powerCycle();
+  }
+
+  uint32 us = micros() - start;
+  recoveries[r].count++;
+  recoveries[r].lastUs = us;
+  if(us > recoveries[r].maxUs){
+    recoveries[r].maxUs = us;
+  }
 }
 
-void standbyPacket(uint8* response)
+/* Prints how often the bus has needed recovering, and how long it took,
+ * whenever that has happened again since the last report. */
+void recoveryReport()
 {
-  uint8 standbyRequest[] = {0xC1, 0x80, 0x01, 0x06};
-  sendCommand(standbyRequest);
-  waitLensLow(); // BUG: Hangs here if the function return doesn't happen fast enough
-  readBytes(response, STANDBY_RESPONSE_BYTES);
+  static const char names[RECOVERIES][12] PROGMEM = {"resync", "power cycle"};
+  static uint16 reported[RECOVERIES];
+  for(uint8 r = 0; r < RECOVERIES; r++){
+    if(recoveries[r].count == reported[r]){
+      continue;
+    }
+    reported[r] = recoveries[r].count;
+    Serial.print(F("Bus "));
+    Serial.print((const __FlashStringHelper*)names[r]);
+    Serial.print(F(": "));
+    Serial.print(recoveries[r].count);
+    Serial.print(F(" times, last "));
+    Serial.print(recoveries[r].lastUs);
+    Serial.print(F(" us, max "));
+    Serial.print(recoveries[r].maxUs);
+    Serial.println(F(" us"));
+  }
+}
 
-  // Print all of the bytes, skipping the checksum at the end
-  /*
-  for(uint8 i = 0; i < STANDBY_RESPONSE_BYTES -1; i++){
-    Serial.print(response[i]);
-    Serial.print(" ");
+/* Asks the lens for its standby packet, and returns the number of bytes
+ * in it, or 0 if it didn't arrive intact. */
+uint16 standbyPacket(uint8* response)
+{
+  // An interrupt in the middle of the handshake (the telemetry UART, or just
+  // the millis() timer) can last long enough to miss an ACK pulse from the
+  // lens, so they only get to run while the lens is waiting for us (see
+  // waitLensHigh()).  That comes round at every byte, well inside the two
+  // bytes the USART can hold for the host's commands.
+  noInterrupts();
+  uint16 nBytes = query(body.standby, response, body.standbyBytes);
+  interrupts();
+  if(busTimedOut){
+    profileDiscard();
+    nBytes = 0;
+  }
+  else if(nBytes){
+    resyncsInARow = 0;
   }
-  Serial.print('\n');
-  */
+  profileFinish();
 
+  // Printing the response here would hold up the bus for milliseconds, so
+  // it's queued for the telemetry port instead.
+  if(standbyTelemetry && nBytes){
+    telemetrySend(TELEMETRY_STANDBY, response, nBytes);
+  }
+  return(nBytes);
 }
 
-void extendedPacket(uint8 data[17])
+/* Sends an extended packet: a command, and then a packet with the details.
+ * Returns true if the lens got both intact. */
+bool extendedPacket(uint32 command, uint8* payload, uint16 nBytes)
 {
+  uint8 bytes[4];
+  commandToBytes(command, bytes);
+  Frame f;
+  frameBeginCommand(f, bytes);
+  uint32 startUs = micros();
+  uint16 start = ticks();
+
+  noInterrupts(); // See standbyPacket()
+  profileStart();
   digitalWrite(BODY_ACK, HIGH);
   waitLensHigh();
 
   // Write 4 bytes
-  writeByte(data[0]);
-  writeByte(data[1]);
-  writeByte(data[2]);
-  writeByte(data[3]);
-  delayMicroseconds(100);
+  while(!frameAtChecksum(f)){
+    writeByte(frameNextByte(f));
+  }
+  profileMark(PHASE_COMMAND);
+  settle(STEP_TURNAROUND, 100);
 
   // Read one byte
-  pinMode(DATA, INPUT);
+  releaseDataLine();
   digitalWrite(BODY_ACK, LOW);
   waitLensRise();
   digitalWrite(BODY_ACK, HIGH);
-  data[4] = readByte();
+  bool ok = (framePutByte(f, readByte()) == FRAME_OK);
 
   digitalWrite(BODY_ACK, LOW);
-  // We really should wait for the lens to be low here
-  delayMicroseconds(250);
+  if(edgeHandshake){
+    waitLensLow();
+  }
+  profileMark(PHASE_CHECKSUM);
+  settle(STEP_PACKET, 250);
   digitalWrite(BODY_ACK, HIGH);
   waitLensHigh();
-
-  // Write 11 bytes
-  for(uint8 i = 5; i < 16; i++){
-    writeByte(data[i]);
+  profileMark(PHASE_HANDOFF);
+
+  // Write the length and payload
+  frameBeginSend(f, payload, nBytes);
+  writeByte(frameNextByte(f));
+  writeByte(frameNextByte(f));
+  profileMark(PHASE_LENGTH);
+  while(!frameAtChecksum(f)){
+    writeByte(frameNextByte(f));
   }
 
   // Wait for the lens to go low; this signals the handoff, just like other checksums
   waitLensLow();
 
   // Read one byte
-  pinMode(DATA, INPUT);
+  releaseDataLine();
   digitalWrite(BODY_ACK, LOW);
   waitLensHigh();
   digitalWrite(BODY_ACK, HIGH);
-  data[16] = readByte();
+  ok = (framePutByte(f, readByte()) == FRAME_OK) && ok;
 
-  delayMicroseconds(100);  // Wait a little while (to match the camera, not sure if necessary)
+  settle(STEP_RELEASE, 100); // Wait a little while (to match the camera, not sure if necessary)
   digitalWrite(BODY_ACK, LOW); // Clean up after ourselves
+  profileMark(PHASE_PAYLOAD);
+  interrupts();
+  if(busTimedOut){
+    profileDiscard();
+    ok = false;
+  }
+  profileFinish();
+  recordTransaction(bytes, recordFlags(ok) | RECORD_SENT, startUs,
+                    ticks() - start, payload, nBytes);
+  return(ok);
+}
+
+/* Times a burst of back-to-back standby packets with each transport and
+ * handshake, and prints the results.  Leaves them set to USE_HARDWARE_SPI
+ * and EDGE_HANDSHAKE.  Telemetry is off while it runs. */
+void throughputTest()
+{
+  standbyTelemetry = false; // It can't keep up, and its interrupts cost time
+  uint8 response[STANDBY_BYTES];
+  // Command, checksum, and the response with its length and checksum
+  const uint32 bytesPerPacket = 4 + 1 + 2 + body.standbyBytes + 1;
+
+  for(uint8 run = 0; run < 4; run++){
+    bool hw = run & 1;
+    edgeHandshake = run & 2;
+    useHardwareSpi(hw);
+    uint32 start = micros();
+    for(uint16 i = 0; i < THROUGHPUT_PACKETS; i++){
+      standbyPacket(response);
+    }
+    uint32 elapsed = micros() - start;
+    uint32 packetRate = 1000000UL * THROUGHPUT_PACKETS / elapsed;
+
+    Serial.print(hw ? F("Hardware SPI, ") : F("Bit-bang, "));
+    Serial.print(edgeHandshake ? F("edges: ") : F("delays: "));
+    Serial.print(elapsed / THROUGHPUT_PACKETS);
+    Serial.print(F(" us/packet, "));
+    Serial.print(packetRate);
+    Serial.print(F(" packets/s, "));
+    Serial.print(packetRate * bytesPerPacket);
+    Serial.println(F(" bytes/s"));
+  }
+  useHardwareSpi(USE_HARDWARE_SPI);
+  edgeHandshake = EDGE_HANDSHAKE;
+  standbyTelemetry = STANDBY_TELEMETRY;
+}
+
+#ifdef FIRMWARE_TEST
+/* Build with -DFIRMWARE_TEST to read the firmware dump (CMD_FIRMWARE) a few
+ * times before starting the normal frame loop, and print how big it was and
+ * how it started.  It's far too big to keep, so only the first few bytes
+ * are, but the checksum covers all of it.  fakelens prints how fast it went
+ * out.  Interrupts are off for the whole dump, as for the standby packet, so
+ * there's no timing it from here. */
+void firmwareTest()
+{
+  uint8 start[8];
+  for(uint8 round = 0; round < FIRMWARE_ROUNDS; round++){
+    noInterrupts(); // See standbyPacket()
+    bool ok = sendCommand(CMD_FIRMWARE);
+    uint16 nBytes = readBytes(start, sizeof(start), true);
+    interrupts();
+    if(busTimedOut){
+      busRecover();
+    }
+
+    Serial.print(F("Firmware dump: "));
+    if(!ok || !nBytes){
+      Serial.println(F("failed"));
+      continue;
+    }
+    Serial.print(nBytes);
+    Serial.print(F(" bytes,"));
+    for(uint8 i = 0; i < sizeof(start); i++){
+      Serial.print(F(" "));
+      Serial.print(start[i], HEX);
+    }
+    Serial.println(F(" ..."));
+  }
+}
+#endif
+
+#ifdef CHARACTERIZE
+/* Build with -DCHARACTERIZE to find the fastest timing the lens will keep
+ * up with, before starting the normal frame loop.  Each hardware SPI clock
+ * is tried, fastest first, with longer and longer setup times before each
+ * byte until CHARACTERIZE_ROUNDS rounds of a C1 F9 query and a standby
+ * query all come back intact, with the same lens info as at power-up.  The
+ * quickest setting that passes is saved in the lens' record, and powerup()
+ * uses it from then on. */
+const uint8 characterizeClocks[] PROGMEM = {SPI_CLOCK_DIV2, SPI_CLOCK_DIV4, SPI_CLOCK_DIV8,
+                                    SPI_CLOCK_DIV16, SPI_CLOCK_DIV32};
+const uint8 characterizeSetupUs[] PROGMEM = {0, 2, 5, 10, 20};
+
+/* Runs rounds of queries at the current timing until one fails.  Returns
+ * the number that passed, and the time they took. */
+uint16 characterizeRounds(uint32& us)
+{
+  uint8 response[STANDBY_BYTES];
+
+  uint32 start = micros();
+  uint16 round;
+  for(round = 0; round < CHARACTERIZE_ROUNDS; round++){
+    noInterrupts(); // See standbyPacket()
+    bool ok = query(CMD_LENS_INFO, response, sizeof(response)) == LENS_INFO_BYTES &&
+              memcmp(response, lens.info, LENS_INFO_BYTES) == 0 &&
+              query(body.standby, response, body.standbyBytes) == body.standbyBytes;
+    interrupts();
+    if(!ok || busTimedOut){
+      break;
+    }
+  }
+  us = micros() - start;
+
+  // A power cycle puts the timing back, so the caller has to set it again
+  if(busTimedOut){
+    busRecover();
+  }
+  return(round);
+}
+
+void characterize()
+{
+  LensTiming best = {LENS_TIMING_NONE, 0};
+  uint32 bestUs = 0xffffffff;
+  useHardwareSpi(true);
+
+  for(uint8 c = 0; c < sizeof(characterizeClocks); c++){
+    uint8 clock = pgm_read_byte(&characterizeClocks[c]);
+    for(uint8 s = 0; s < sizeof(characterizeSetupUs); s++){
+      uint8 setup = pgm_read_byte(&characterizeSetupUs[s]);
+      useTiming(clock, setup);
+      uint32 us;
+      uint16 passed = characterizeRounds(us);
+
+      Serial.print(F("SPI at "));
+      Serial.print(spiClockKhz(clock));
+      Serial.print(F(" kHz, "));
+      Serial.print(setup);
+      Serial.print(F(" us before each byte: "));
+      if(passed < CHARACTERIZE_ROUNDS){
+        Serial.print(F("failed after "));
+        Serial.print(passed);
+        Serial.println(F(" rounds"));
+        continue;
+      }
+      Serial.print(us / CHARACTERIZE_ROUNDS);
+      Serial.println(F(" us per round"));
+      if(us < bestUs){
+        bestUs = us;
+        best.spiClock = clock;
+        best.byteSetupUs = setup;
+      }
+      break; // Longer setup times only slow this clock down
+    }
+  }
+
+  if(best.spiClock == LENS_TIMING_NONE){
+    Serial.println(F("No timing was reliable; keeping the defaults"));
+  }
+  else{
+    lens.timing = best;
+    lensRecordStore(lens);
+    Serial.print(F("Saved SPI at "));
+    Serial.print(spiClockKhz(best.spiClock));
+    Serial.print(F(" kHz, "));
+    Serial.print(best.byteSetupUs);
+    Serial.println(F(" us before each byte"));
+  }
+
+  useHardwareSpi(USE_HARDWARE_SPI);
+  if(lens.timing.spiClock != LENS_TIMING_NONE){
+    useTiming(lens.timing.spiClock, lens.timing.byteSetupUs);
+  }
+  else{
+    useTiming(SPI_CLOCK, 0);
+  }
+}
+#endif
+
+/* Extended commands waiting for a free slot.  Each frame sends at most one,
+ * after the standby packet, if there's time for it before the next frame. */
+#define QUEUE_SLOTS 8 // Must be a power of 2
+
+#define NO_ACK -1
+#define FOCUS_ACK -2 // The focus controller's own commands (see focus.h)
+
+struct ExtendedCommand
+{
+  uint32 command;
+  uint8 payload[EXTENDED_PAYLOAD_BYTES];
+  int16 ackTag; // Host's tag to acknowledge once it's sent, NO_ACK or FOCUS_ACK
+};
+
+ExtendedCommand commandQueue[QUEUE_SLOTS];
+uint8 queueHead = 0; // Next slot to fill
+uint8 queueTail = 0; // Next command to send
+
+// Host command that has gone to the lens, waiting for the next standby
+// response to acknowledge it with
+int16 pendingAck = NO_ACK;
+uint8 pendingStatus;
+
+/* Adds an extended command to the queue, leaving the payload for the
+ * caller to fill in.  Returns NULL if the queue was full. */
+ExtendedCommand* queueNext(uint32 command, int16 ackTag)
+{
+  uint8 next = (queueHead + 1) & (QUEUE_SLOTS - 1);
+  if(next == queueTail){
+    return(NULL);
+  }
+  ExtendedCommand* c = &commandQueue[queueHead];
+  c->command = command;
+  c->ackTag = ackTag;
+  queueHead = next;
+  return(c);
+}
+
+/* Adds an extended command to the queue.  Returns false if it was full. */
+bool queueCommand(uint32 command, const uint8* payload, int16 ackTag = NO_ACK)
+{
+  ExtendedCommand* c = queueNext(command, ackTag);
+  if(c){
+    memcpy(c->payload, payload, EXTENDED_PAYLOAD_BYTES);
+  }
+  return(c != NULL);
 }
 
-inline void pulseShutter(void)
+// Same, for a payload in program memory
+bool queueCommand_P(uint32 command, const uint8* payload)
 {
-  digitalWrite(SHUTTER, HIGH);
-  delayMicroseconds(500);
-  digitalWrite(SHUTTER, LOW);
+  ExtendedCommand* c = queueNext(command, NO_ACK);
+  if(c){
+    memcpy_P(c->payload, payload, EXTENDED_PAYLOAD_BYTES);
+  }
+  return(c != NULL);
 }
 
+bool zoomCalibrating = false; // Sampling for the zoom table rather than tracking
+
+/* Starts or finishes a zoom calibration (see zoomtrack.h).  Finishing saves
+ * the table with the lens' record, which holds up the bus for a few frames
+ * while the EEPROM is written.  Returns false if it couldn't. */
+bool zoomCalibrate(bool start)
+{
+  if(start){
+    zoomCalibrateStart();
+    zoomCalibrating = true;
+    Serial.println(F("Zoom calibration: zoom slowly through the range, keeping the image in focus"));
+    return(true);
+  }
+  if(!zoomCalibrating){
+    return(false);
+  }
+  zoomCalibrating = false;
+  if(!zoomCalibrateFinish(lens.zoom)){
+    Serial.println(F("Zoom calibration: not enough of the range was covered"));
+    return(false);
+  }
+  lensRecordStore(lens);
+  zoomTrackStart();
+
+  Serial.print(F("Zoom table:"));
+  for(uint8 i = 0; i < ZOOM_TABLE_POINTS; i++){
+    Serial.print(F(" "));
+    Serial.print(lens.zoom.focus[i]);
+  }
+  Serial.println();
+  return(true);
+}
+
+// Queues a focus command from the focus controller
+void queueFocus(int32 position)
+{
+  uint8 payload[EXTENDED_PAYLOAD_BYTES] = {0x01, 0x00, 0x00, 0x00, 0x00};
+  for(uint8 i = 0; i < 4; i++){
+    payload[5 + i] = position >> (8 * i);
+  }
+  if(!queueCommand(CMD_FOCUS, payload, FOCUS_ACK)){
+    focusSent(false); // Try again next frame
+  }
+}
+
+// Prints how a focus move went, and sends it to the host (see telemetry.h)
+void focusReport(const FocusResult& r)
+{
+  uint8 payload[11];
+  payload[0] = r.target;
+  payload[1] = r.target >> 8;
+  payload[2] = r.position;
+  payload[3] = r.position >> 8;
+  for(uint8 i = 0; i < 4; i++){
+    payload[4 + i] = r.settleUs >> (8 * i);
+  }
+  payload[8] = r.overshoot;
+  payload[9] = r.overshoot >> 8;
+  payload[10] = r.corrections | (r.settled ? FOCUS_SETTLED : 0);
+  telemetrySend(TELEMETRY_FOCUS, payload, sizeof(payload));
+
+  Serial.print(F("Focus to "));
+  Serial.print(r.target);
+  if(r.settled){
+    Serial.print(F(": settled in "));
+  }
+  else{
+    Serial.print(F(": gave up at "));
+    Serial.print(r.position);
+    Serial.print(F(" after "));
+  }
+  Serial.print(r.settleUs / 1000);
+  Serial.print(F(" ms, overshoot "));
+  Serial.print(r.overshoot);
+  Serial.print(F(", corrections "));
+  Serial.println(r.corrections);
+}
+
+/* Sends the command at the head of the queue, if there is one and it will
+ * fit in what's left of the frame. */
+void sendQueuedCommand()
+{
+  if(queueTail == queueHead || cadenceLeftUs() < EXTENDED_PACKET_US){
+    return;
+  }
+  ExtendedCommand& c = commandQueue[queueTail];
+  bool ok = extendedPacket(c.command, c.payload, EXTENDED_PAYLOAD_BYTES);
+  if(c.ackTag == FOCUS_ACK){
+    focusSent(ok);
+  }
+  else if(c.ackTag != NO_ACK){
+    pendingAck = c.ackTag;
+    pendingStatus = ok ? ACK_OK : ACK_BUS_ERROR;
+  }
+  queueTail = (queueTail + 1) & (QUEUE_SLOTS - 1);
+}
+
+/* Moves commands from the host onto the queue for the bus.  Any that can't
+ * go are acknowledged straight away, along with the latest standby
+ * response.  Returns true if there were any. */
+bool takeHostCommands(const uint8* standby, uint8 nBytes)
+{
+  bool any = false;
+  HostCommand h;
+
+  while(controlReceive(h)){
+    any = true;
+    uint8 payload[EXTENDED_PAYLOAD_BYTES] = {0x01};
+    uint32 command;
+    bool known = true;
+
+    if(h.opcode == CONTROL_APERTURE && h.length == 2){
+      command = CMD_APERTURE;
+      payload[1] = h.args[0];
+      payload[2] = h.args[1];
+    }
+    else if(h.opcode == CONTROL_FOCUS && h.length == 4){
+      command = CMD_FOCUS;
+      memcpy(payload + 5, h.args, 4);
+    }
+    else if(h.opcode == CONTROL_EXTENDED && h.length == 4 + EXTENDED_PAYLOAD_BYTES){
+      command = commandFromBytes(h.args);
+      memcpy(payload, h.args + 4, EXTENDED_PAYLOAD_BYTES);
+    }
+    else if(h.opcode == CONTROL_ZOOM_CALIBRATE && h.length == 1){
+      bool ok = zoomCalibrate(h.args[0]);
+      telemetrySend(TELEMETRY_ACK, h.tag, ok ? ACK_OK : ACK_FAILED, standby, nBytes);
+      continue;
+    }
+    else if(h.opcode == CONTROL_FOCUS_TO && h.length == 2){
+      // The controller sends its own commands, and reports when it's done
+      focusMoveTo(h.args[0] | (h.args[1] << 8));
+      telemetrySend(TELEMETRY_ACK, h.tag, ACK_OK, standby, nBytes);
+      continue;
+    }
+    else{
+      known = false;
+    }
+
+    if(!known){
+      telemetrySend(TELEMETRY_ACK, h.tag, ACK_BAD_COMMAND, standby, nBytes);
+    }
+    else if(!queueCommand(command, payload, h.tag)){
+      telemetrySend(TELEMETRY_ACK, h.tag, ACK_QUEUE_FULL, standby, nBytes);
+    }
+  }
+  return(any);
+}
+
+// Payload for the extended setup command that main() sends on its own
+const uint8 setupPayload[EXTENDED_PAYLOAD_BYTES] PROGMEM = {0x01};
+
+// Focus positions to sweep between until the host takes over: where the old
+// "all the way in" (0x0001ffd7) command ended up, and "a bit out"
+const uint16 sweepTargets[2] PROGMEM = {0x03ff, 0x024e};
+
 int main()
 {
   init(); // Arduino library initialization
   setup(); // Pin setup and other init
+  tickTimerStart();
+  useHardwareSpi(USE_HARDWARE_SPI);
   powerup();
+  lensReport();
+
+#ifdef THROUGHPUT_TEST
+  // Build with -DTHROUGHPUT_TEST to compare the transports before starting
+  throughputTest();
+#endif
+
+#ifdef FIRMWARE_TEST
+  firmwareTest();
+#endif
 
-  uint16 packetNum = 0; // Count of how many packets we've sent
-  uint8 standbyResponse[STANDBY_RESPONSE_BYTES]; // Last standby response we've gotten
+#ifdef CHARACTERIZE
+  characterize();
+#endif
+
+  uint16 telemetryLost = 0; // Dropped telemetry frames we've reported
+  uint16 controlLost = 0; // Likewise for commands from the host
+  bool hostControl = false; // True once the host has sent a command
+  uint8 standbyResponse[STANDBY_BYTES]; // Last standby response we've gotten
+  StandbyView standby = standbyView(standbyResponse);
+  bool apertureSet = false;
+
+  // Unknown (but presumably important) setup command, which goes out in the
+  // first frame
+  queueCommand_P(CMD_EXTENDED_SETUP, setupPayload);
+
+  cadenceStart(FRAME_RATE);
 
   while(1){
-    if(packetNum == 1){
-      // Unknown (but presumably important) setup command
-      delay(9);
-      pulseShutter();
-      delayMicroseconds(1500);
-      standbyPacket(standbyResponse);
-
-      // Now send an extended packet with an aperture command
-      uint8 one[] = {0x60, 0x80, 0x06, 0xfe, 0x00,
-                     0x0a, 0x00,
-                     0x01, 0x00, 0x00, 0x00, 0x00,
-                     0x00, 0x00, 0x00, 0x00, 0x00};
-      extendedPacket(one);
-
-      delay(4);
-      digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+    uint16 frame = cadenceWaitSlot();
+    uint16 nBytes = standbyPacket(standbyResponse);
+    if(busTimedOut){
+      busRecover();
     }
-    else if(packetNum == 3){
-      // Aperture command
-      delay(9);
-      pulseShutter();
-      delayMicroseconds(1500);
-      standbyPacket(standbyResponse);
-
-      // Now send an extended packet with an aperture command
-      uint8 one[] = {0x60, 0x80, 0xfe, 0x02, 0x00,
-                     0x0a, 0x00,
-                     0x01, standbyResponse[8] + 1, standbyResponse[9], 0x00, 0x00,
-                     0x00, 0x00, 0x00, 0x00, 0x00};
-      extendedPacket(one);
-
-      delay(4);
-      digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+
+    // The last command sent took effect on this response, give or take
+    if(pendingAck != NO_ACK && nBytes){
+      telemetrySend(TELEMETRY_ACK, pendingAck, pendingStatus, standbyResponse, nBytes);
+      pendingAck = NO_ACK;
     }
-    else if(packetNum % 60 == 3){
-      // Aperture command
-      delay(9);
-      pulseShutter();
-      delayMicroseconds(1500);
-      standbyPacket(standbyResponse);
-
-      // Now send an extended packet with a command
-      uint8 one[] = {0x60, 0x80, 0x03, 0xfe, 0x00,
-                     0x0a, 0x00,
-                     0x01, 0x00, 0x00, 0x00, 0x00,
-                     0xd7, 0xff, 0x01, 0x00, 0x00}; // All the way in?
-      extendedPacket(one);
-
-      delay(4);
-      digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+    hostControl = takeHostCommands(standbyResponse, nBytes) || hostControl;
+
+    // Something to exercise the lens with until the host takes over: nudge
+    // the aperture once we know where it is, and then start a focus move in
+    // or out every half second.
+    if(hostControl){
+      // Leave it alone
     }
-    else if(packetNum % 60 == 33){
-      // Aperture command
-      delay(9);
-      pulseShutter();
-      delayMicroseconds(1500);
-      standbyPacket(standbyResponse);
-
-      // Now send an extended packet with an aperture command
-      uint8 one[] = {0x60, 0x80, 0x03, 0xfe, 0x00,
-                     0x0a, 0x00,
-                     0x01, 0x00, 0x00, 0x00, 0x00,
-                     0x4e, 0x02, 0x00, 0x00, 0x00}; // A bit out
-      extendedPacket(one);
-
-      delay(4);
-      digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+    else if(!apertureSet){
+      // Stop down by 1/256 EV from where it is
+      uint16 av = standbyAperture(standby) + 1;
+      const uint8 payload[EXTENDED_PAYLOAD_BYTES] = {0x01, (uint8)av, (uint8)(av >> 8)};
+      apertureSet = queueCommand(CMD_APERTURE, payload);
     }
-    else{
-      // Just a standby packet
-      delay(9);
-      pulseShutter();
-      delayMicroseconds(1500);
-      standbyPacket(standbyResponse);
-
-      delay(4);
-      digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+    else if(frame % (FRAME_RATE / 2) == 0){
+      focusMoveTo(pgm_read_word(&sweepTargets[(frame / (FRAME_RATE / 2)) & 1]));
+    }
+
+    // Keep the focus where it was as the lens zooms, or learn how to
+    if(nBytes && zoomCalibrating){
+      zoomCalibrateSample(standby);
+    }
+    else if(nBytes && lens.zoom.calibrated && !focusBusy()){
+      uint16 target;
+      if(zoomTrack(lens.zoom, standby, target)){
+        focusMoveTo(target);
+      }
+    }
+
+    // Check the focus against where it's meant to be going
+    int32 focusCommand;
+    if(nBytes && focusUpdate(standby, focusCommand)){
+      queueFocus(focusCommand);
+    }
+
+    sendQueuedCommand();
+    if(busTimedOut){
+      busRecover();
+    }
+
+    FocusResult focusMove;
+    if(focusFinished(focusMove)){
+      focusReport(focusMove);
+    }
+    digitalWrite(FOCUS, !digitalRead(FOCUS)); // Flip the focus pin
+
+    if(frame % FRAME_RATE == 0){
+      cadenceReport();
+      recoveryReport();
+      if(telemetryDropped() != telemetryLost){
+        telemetryLost = telemetryDropped();
+        Serial.print(F("Telemetry frames dropped: "));
+        Serial.println(telemetryLost);
+      }
+      if(controlErrors() != controlLost){
+        controlLost = controlErrors();
+        Serial.print(F("Host commands dropped: "));
+        Serial.println(controlLost);
+      }
+    }
+
+#ifdef HANDSHAKE_REPORT
+    if(frame % FRAME_RATE == 0){
+      Serial.print(F("Bus time per frame: "));
+      Serial.print(waitingTicks / (FRAME_RATE * TICKS_PER_US));
+      Serial.print(F(" us waiting, "));
+      Serial.print(transferTicks / (FRAME_RATE * TICKS_PER_US));
+      Serial.println(F(" us transferring"));
+      waitingTicks = 0;
+      transferTicks = 0;
+    }
+#endif
+
+    // Send a 'p' to print the profile or a 'c' to clear it (with -DPROFILE),
+    // an 'r' to flush the recording (with -DRECORD), a 'z' to start or finish
+    // a zoom calibration, or an 'm' for the SRAM usage
+    profileUpdate();
+    recorderFlush();
+    if(Serial.available()){
+      uint8 c = Serial.read();
+      if(c == 'p'){ profileDump(); }
+      else if(c == 'c'){ profileClear(); }
+      else if(c == 'r'){ recorderFlushStart(); }
+      else if(c == 'z'){ zoomCalibrate(!zoomCalibrating); }
+      else if(c == 'm'){ memoryReport(); }
     }
-    packetNum++;
   }
 
 
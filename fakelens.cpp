@@ -2,11 +2,147 @@
  * Code that pretends to be a lens and talks to the body.
  * Steven Bell <sebell@stanford.edu>
  * 27 September 2012
+ *
+ * Bus transactions are driven entirely by two interrupts: a pin change on
+ * BODY_ACK and SPI transfer complete.  Each one moves a small state machine
+ * along, so the main loop is free to do everything else, and our response
+ * to the body is only as slow as the interrupt latency.
  */
 
-#include "Arduino.h"
 #include "typedef.h"
 #include "common.h"
+#include "hal.h"
+#include "profile.h"
+#include "standby.h"
+#include "lensmodel.h"
+#include "recorder.h"
+#include "commands.h"
+#include "memory.h"
+#include "body.h"
+
+// Width of the pulse we put on LENS_ACK after each byte received
+#define ACK_PULSE_US 2
+
+// If the body leaves a transaction hanging for this long, we give up on it
+// and go back to waiting for a command.  The body's own wait budget is
+// shorter, and it holds the bus quiet for longer than this to resync.
+#define TRANSACTION_TIMEOUT_US 2000
+
+/* Build with -DDROP_TEST to ignore every DROP_EVERY'th byte from the SPI
+ * hardware, as if the interrupt had been missed, to exercise the body's
+ * timeouts and recovery. */
+#define DROP_EVERY 5000
+
+/* Where we are in a bus transaction.  Each state is named after what we are
+ * waiting for next. */
+enum LensState {
+  IDLE, // BODY_ACK to rise, starting a command
+  RX_BYTE, // Command or packet bytes from the body
+  RX_CHECKSUM, // BODY_ACK to fall so that we can send back the checksum
+  TX_BYTE, // The body to clock out the byte we have loaded
+  TX_NEXT, // BODY_ACK to fall so that we can load the next byte
+  PACKET_START, // BODY_ACK to rise before the body sends a packet
+  HANDSHAKE_RISE, // BODY_ACK to rise, for an extra fall-rise sequence
+  HANDSHAKE_DELAY, // The main loop to finish a long pause in the handshake
+  HANDSHAKE_FALL, // BODY_ACK to fall at the end of the extra sequence
+  END // BODY_ACK to fall, ending the transaction
+};
+
+// Transaction state, shared between the two interrupt handlers
+volatile LensState state = IDLE;
+bool inCommand; // True until the command itself has been handled
+uint8 command[4]; // Command bytes, in the order they were sent
+
+Frame rx; // Command or packet coming from the body
+Frame tx; // Packet going to the body
+bool txLast; // True if the byte loaded is the last of the transaction
+
+uint16 handshakeDelay; // Length of the pause in an extra handshake, in ms
+uint32 handshakeStart;
+
+uint8 packet[16]; // Packets received from the body
+void (*onPacket)(); // What to do with the packet once it has arrived, if anything
+
+/* Commands we didn't recognize, with micros() when they came, for the main
+ * loop to report once the bus is idle.  Only dispatch() moves unknownHead
+ * and only the main loop moves unknownTail, so neither side has to wait
+ * for the other.  When the log is full, the newest are counted and lost. */
+#define UNKNOWN_LOG 8 // Must be a power of 2
+
+struct UnknownCommand
+{
+  uint32 command; // As the table has it
+  uint32 us;
+};
+
+UnknownCommand unknownLog[UNKNOWN_LOG];
+volatile uint8 unknownHead = 0;
+volatile uint8 unknownTail = 0;
+volatile uint16 unknownLost = 0;
+
+// Packets from the body that were too long for us
+volatile uint8 droppedPackets = 0;
+
+// Bumped by both interrupt handlers, so the main loop can tell when a
+// transaction has stalled
+volatile uint8 busActivity = 0;
+volatile uint8 abandoned = 0; // Transactions we gave up on
+
+// Responses, which go onto the bus straight from program memory
+constexpr uint8 lensId[4] PROGMEM = {0x0a, 0x10, 0xc4, 0x09};
+
+// Information contained in here:
+// Aperture limits, focus limits, zoom?
+// Firmware version
+// Vendor
+constexpr uint8 lensInfo[20] PROGMEM = {0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x41, 0x41,
+                                0x42, 0x32, 0x32, 0x33, 0x34, 0x36, 0x35, 0x00,
+                                0x00, 0x00, 0x01, 0x11};
+
+// See standby.h for what we know of the layout
+const uint8 standbyInitial[STANDBY_BYTES] PROGMEM = {0xc2, 0xe1, 0x00, 0x00, // Status
+                     0x00, 0x0c, // 4/5: Raw zoom, raw focus
+                     0x42, 0x00, // 6/7: Focus distance
+                     0xb1, 0x03, // 8/9: Effective aperture
+                     0x00, 0x0c, // 10/11: Scaled zoom
+                     0x0c, 0x00, // 12-13: raw focus?
+                     0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01,
+                     0x47, 0x02, 0xa4, 0x5c, 0x03, 0x4e, 0x02};
+
+// What we send, updated by the main loop (see sendStandby())
+StandbySnapshot standby;
+
+/* The body we're talking to (see body.h), which we find out from its
+ * standby command.  Until then it's BODY_MODELS. */
+volatile uint8 bodyModel = BODY_MODELS;
+volatile bool bodyPending = false; // For the main loop to report
+
+// The standby packet always goes out whole, with the checksum standby.cpp
+// keeps for it, so every body has to want the same length
+constexpr bool standbyFits(uint8 b = 0)
+{
+  return(b == BODY_MODELS ||
+         (bodyProfiles[b].standbyBytes == STANDBY_BYTES && standbyFits(b + 1)));
+}
+
+static_assert(standbyFits(), "A body wants a standby packet of a different length");
+
+/* The answer to CMD_FIRMWARE, which is far too big for SRAM, so it streams
+ * onto the bus from program memory a byte at a time like any other
+ * response.  Build with -DFIRMWARE_DUMP to send a real dump from
+ * firmwaredump.h (decode --firmware writes one from a capture); otherwise
+ * it's all zeros, which is what we used to try to send. */
+#ifdef FIRMWARE_DUMP
+#include "firmwaredump.h"
+#else
+const uint8 firmwareDump[0x08BF - 1] PROGMEM = {0}; // The length counts the checksum
+#endif
+
+// How long the last dump took, for the main loop to report
+bool firmwareSending = false;
+uint32 firmwareStart;
+volatile uint32 firmwareUs;
+volatile bool firmwarePending = false;
 
 /* Performs one-time pin initialization and other setup.  The pin directions
  * here are the opposite of fakebody, since we're playing the other side. */
@@ -14,370 +150,704 @@ void setup() {
   Serial.begin(115200);
   pinMode(SLEEP, INPUT);
   pinMode(BODY_ACK, INPUT);
+  pinMode(BODY_ACK_INT, INPUT);
   pinMode(LENS_ACK, OUTPUT);
   pinMode(FOCUS, INPUT);
   pinMode(SHUTTER, INPUT);
   digitalWrite(FOCUS, LOW); // Turn off the pull-ups just to be sure
   digitalWrite(SHUTTER, LOW);
 
-  // Configure the SPI hardware
-  // SPE - Enable
-  // DORD - Set data order to LSB-first
-  // Slave mode (Master bit is not set)
-  // CPOL - Set clock polarity to "normally high"
-  // CPHA - Set to read on trailing (rising) edge
-  SPCR = (1<<SPE) | (1<<DORD) | (1<<CPOL) | (1<<CPHA);
-
-  // Set up the SPI pins
+  // Set up the SPI pins.  The SPI hardware itself is only switched on
+  // during a transaction.
   pinMode(CLK, INPUT);
   pinMode(DATA_MISO, INPUT); // Until we have an explicit write, make both inputs
   pinMode(DATA_MOSI, INPUT);
 }
-// Wait for a falling edge on the body ACK pin
-inline void waitBodyFall()
+
+// Tell the body we've taken a byte and are ready for the next one
+inline void pulseAck()
 {
-  while(!(BODY_ACK_PIN & BODY_ACK_HIGH)){} // Wait until it's high first
-  while(BODY_ACK_PIN & BODY_ACK_HIGH){}
+  setLensAck(LOW); // Working
+  delayMicroseconds(ACK_PULSE_US);
+  setLensAck(HIGH); // Ready
 }
 
-// Wait for a rising edge on the body ACK pin
-inline void waitBodyRise()
+// Load a byte into the SPI hardware for the body to clock out
+void loadByte(uint8 value, bool last)
 {
-  while(BODY_ACK_PIN & BODY_ACK_HIGH){} // Wait until it's low first
-  while(!(BODY_ACK_PIN & BODY_ACK_HIGH)){}
+  spiWrite(value);
+  driveData();
+  txLast = last;
+  state = TX_BYTE;
 }
 
-// Wait until the body ACK pin is low
-inline void waitBodyLow()
+/* Load the next byte of the packet we're sending.  LENS_ACK only goes high
+ * again once it's loaded, since the body may start clocking straight away. */
+void loadNext()
 {
-  delayMicroseconds(2);
-  while(BODY_ACK_PIN & BODY_ACK_HIGH){}
+  setLensAck(LOW); // Working
+  uint8 value = frameNextByte(tx);
+  loadByte(value, frameDone(tx));
+  delayMicroseconds(ACK_PULSE_US);
+  setLensAck(HIGH); // Ready
 }
 
-// Wait until the body ACK pin is high
-inline void waitBodyHigh()
+// Send # bytes, bytes, checksum
+void beginSend(const uint8* bytes, uint16 nBytes)
 {
-  delayMicroseconds(2);
-  while(!(BODY_ACK_PIN & BODY_ACK_HIGH)){}
+  frameBeginSend(tx, bytes, nBytes);
+  loadByte(frameNextByte(tx), false);
+  setLensAck(HIGH);
 }
 
-/* Reads a single byte from the SPI bus.
- * Data is read LSB-first
- */
-uint8 readByte()
+// Same as beginSend(), for a packet whose checksum is already known
+void beginSend(const uint8* bytes, uint16 nBytes, uint8 checksum)
 {
-  SPCR = (1<<SPE) | (1<<DORD) | (1<<CPOL) | (1<<CPHA);
-  pinMode(DATA_MISO, INPUT); // Just in case it was an output last
+  frameBeginSend(tx, bytes, nBytes, checksum);
+  loadByte(frameNextByte(tx), false);
+  setLensAck(HIGH);
+}
 
-  // Clear the SPIF bit from any previously received bytes by reading SPDR
-  SPDR = 0x00;
+// Same as the two above, for packets in program memory
+void beginSend_P(const uint8* bytes, uint16 nBytes)
+{
+  frameBeginSend_P(tx, bytes, nBytes);
+  loadByte(frameNextByte(tx), false);
+  setLensAck(HIGH);
+}
 
-  // Wait until we receive a byte
-  while(!(SPSR & (1<<SPIF))) {}
+void beginSend_P(const uint8* bytes, uint16 nBytes, uint8 checksum)
+{
+  frameBeginSend_P(tx, bytes, nBytes, checksum);
+  loadByte(frameNextByte(tx), false);
+  setLensAck(HIGH);
+}
 
-  SPCR = 0x00;
-  return(SPDR);
+// Send a lone byte, which ends the transaction
+void sendByte(uint8 value)
+{
+  loadByte(value, true);
 }
 
-/* Writes an 8-bit value on the data bus.  The clock is driven by the body.
- */
-void writeByte(uint8 value)
+/* Command handlers.  Each one sets up the rest of the transaction once the
+ * command itself is finished, and runs from the interrupt. */
+struct LensCommand;
+typedef void (*CommandHandler)(const LensCommand& c);
+
+struct LensCommand
 {
-  SPCR = (1<<SPE) | (1<<DORD) | (1<<CPOL) | (1<<CPHA);
-  // Set the bytes we want to write
-  SPDR = value;
+  uint32 command; // Bytes in reverse order from the way they are transmitted
+  CommandHandler handler;
+  const uint8* response; // Constant response in program memory, if any
+  uint8 length;
+  uint8 checksum; // Of the response
+};
+
+// Sends a constant response, whose checksum was worked out at compile time
+void sendResponse(const LensCommand& c)
+{
+  beginSend_P(c.response, c.length, c.checksum);
+}
 
-  // Set the MISO pin to be an output
-  DATA_DIR |= DATA_MISO_WRITE;
+/* Sends whichever copy of the standby packet is current, with the checksum
+ * that was kept up as it changed.  It's ours until the transaction ends. */
+void sendStandby(const LensCommand& c)
+{
+  if(bodyModel == BODY_MODELS){
+    bodyModel = bodyFromStandby(c.command);
+    bodyPending = true;
+  }
+  uint8 b = standbyTake(standby);
+  beginSend(standby.bytes[b], STANDBY_BYTES, standby.checksum[b]);
+}
 
-  // Wait until transmission is finished
-  while(!(SPSR & (1<<SPIF))) {}
+// Sends the firmware dump, summing it as it goes
+void sendFirmware(const LensCommand&)
+{
+  firmwareStart = micros();
+  firmwareSending = true;
+  beginSend_P(firmwareDump, sizeof(firmwareDump));
+}
 
-  // Clear SPIF
-  // BUG: When this was set to 0x00, it didn't do anything.  Perhaps it was optimized away?
-  SPDR = 0xFF;
-  SPCR = 0x00;
+// The body follows up with a packet of its own
+void receivePacket(const LensCommand&)
+{
+  onPacket = NULL;
+  state = PACKET_START;
 }
 
-/* Reads a number of bytes and then transmits the checksum.
- * nBytes - Number of bytes to read.  Must be greater than zero.
- */
-void readBytesChecksum(uint8 nBytes, uint8* values)
+// The packet after an aperture command has the new aperture in bytes 1-2
+void setAperture()
+{
+  if(framePayloadBytes(rx) >= 3){
+    lensModelSetTarget(ACTUATOR_APERTURE, packet[1] | (packet[2] << 8));
+  }
+}
+
+void receiveAperture(const LensCommand&)
 {
-  uint8 checksum = 0;
+  onPacket = setAperture;
+  state = PACKET_START;
+}
 
-  for(uint8 i = 0; i < nBytes - 1; i++){
-    values[i] = readByte();
-    checksum += values[i];
-    digitalWrite(LENS_ACK, 0); // Working
-    digitalWrite(LENS_ACK, 1); // Ready
+/* The packet after a focus command has a signed 32-bit position in bytes
+ * 5-8.  The body asks for 0x0001ffd7 to go all the way in, which is well
+ * past the end, so we take it as a target that gets clamped. */
+void setFocus()
+{
+  if(framePayloadBytes(rx) >= 9){
+    int32 target = (int32)((uint32)packet[5] | ((uint32)packet[6] << 8) |
+                           ((uint32)packet[7] << 16) | ((uint32)packet[8] << 24));
+    lensModelSetTarget(ACTUATOR_FOCUS, target);
   }
+}
+
+void receiveFocus(const LensCommand&)
+{
+  onPacket = setFocus;
+  state = PACKET_START;
+}
 
-  // Last byte
-  values[nBytes - 1] = readByte();
-  checksum += values[nBytes - 1];
-  digitalWrite(LENS_ACK, 0); // Working
-  // Note: No ready here, we're waiting for the body to drop
+// There's a extra fall-rise sequence for some reason, with a long pause
+void slowHandshake(const LensCommand&)
+{
+  profileDiscard(); // Far too long for the tick timer
+  handshakeDelay = 500;
+  state = HANDSHAKE_RISE;
+}
 
-  // Now we reply with the checksum
-  waitBodyFall();
-  digitalWrite(LENS_ACK, 1); // Ready
-  waitBodyHigh();
-  writeByte(checksum);
+// Same again, with the pause the body leaves (none, so far).  Why is our
+// ack line low here?
+void fastHandshake(const LensCommand&)
+{
+  profileDiscard();
+  handshakeDelay = bodyModel == BODY_MODELS ? 0 :
+                   pgm_read_word(&bodyProfiles[bodyModel].focusSetupPauseMs);
+  state = HANDSHAKE_RISE;
 }
 
-// # bytes, bytes, checksum
-void writeBytesChecksum(uint8 nBytes, uint8* values)
+void noResponse(const LensCommand&)
 {
-  uint8 checksum = 0;
+  state = IDLE;
+}
 
-  // Write the first byte, which is the number of bytes in the packet
-  //waitBodyFall(); // Wait for body to drop
-  //digitalWrite(LENS_ACK, 0); // We drop and then rise (ready to send next byte)
-  digitalWrite(LENS_ACK, 1);
-  writeByte(nBytes);
+constexpr uint8 sum(const uint8* bytes, uint8 n)
+{
+  return(n == 0 ? 0 : bytes[0] + sum(bytes + 1, n - 1));
+}
 
-  // Now write the byte values themselves
-  for(uint8 i = 0; i < nBytes; i++){
-    waitBodyLow();
-    digitalWrite(LENS_ACK, 0);
-    digitalWrite(LENS_ACK, 1);
-    writeByte(values[i]);
-    checksum += values[i]; // Keep a running total
-  }
+// Fills in the response fields of a table entry
+#define RESPONSE(bytes) bytes, sizeof(bytes), sum(bytes, sizeof(bytes))
+
+constexpr LensCommand commands[] PROGMEM = {
+  {CMD_INIT, slowHandshake, NULL, 0, 0},
+  {CMD_LENS_ID, sendResponse, RESPONSE(lensId)},
+  // A0 F5 01 00 is followed by dropping the clock pin for a ms.  The SPI
+  // hardware is off between transactions, so this can't upset it.
+  {CMD_CLOCK_RESET, noResponse, NULL, 0, 0},
+  {CMD_LENS_INFO, sendResponse, RESPONSE(lensInfo)},
+  {CMD_SETUP, receivePacket, NULL, 0, 0},
+  // Standby packet
+  {CMD_STANDBY, sendStandby, NULL, 0, 0}, // E-PL1
+  {CMD_STANDBY_EP1, sendStandby, NULL, 0, 0}, // E-P1
+  // Extended packets - aperture, focus, etc.
+  {CMD_EXTENDED_SETUP, receivePacket, NULL, 0, 0},
+  {CMD_APERTURE, receiveAperture, NULL, 0, 0},
+  {CMD_FOCUS, receiveFocus, NULL, 0, 0},
+  {CMD_FOCUS_SETUP, fastHandshake, NULL, 0, 0},
+  {CMD_FIRMWARE, sendFirmware, NULL, 0, 0},
+  // 0x0000f3c2 is still a mystery, and is reported as unknown
+};
+
+#define N_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// How many times each command in the table has come in, and how many
+// commands weren't in it, since power on.  Send an 'h' to print them.
+volatile uint32 commandHits[N_COMMANDS];
+volatile uint32 unknownHits = 0;
+
+/* Commands are looked up by their checksum, which we already have by the time
+ * the command finishes.  The slots are checked at compile time so that no two
+ * commands share one. */
+#define COMMAND_SLOTS 64
+#define NO_COMMAND 0xff
+
+constexpr uint8 commandSlot(uint8 commandSum)
+{
+  return(commandSum & (COMMAND_SLOTS - 1));
+}
 
-  // Finally, write the checksum
-  waitBodyLow();
-  digitalWrite(LENS_ACK, 0);
-  digitalWrite(LENS_ACK, 1);
-  writeByte(checksum);
+constexpr uint8 commandSlot(uint32 command)
+{
+  return(commandSlot((uint8)(command + (command >> 8) + (command >> 16) + (command >> 24))));
 }
 
-void standbyPacket(void)
+// Returns the index of the command in the given slot, or NO_COMMAND
+constexpr uint8 slotCommand(uint8 slot, uint8 i = 0)
 {
-  uint8 values[31] = {0x00, // Probably part of the length, but writeBytesChecksum assumes 1-byte length for now
-                      0xc2, 0xe1, 0x00, 0x00, // Status
-                      0x00, 0x0c, // 4/5: Raw zoom, raw focus
-                      0x42, 0x00, // 6/7: Focus distance
-                      0xb1, 0x03, // 8/9: Effective aperture
-                      0x00, 0x0c, // 10/11: Scaled zoom
-                      0x0c, 0x00, // 12-13: raw focus?
-                      0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01,
-                      0x47, 0x02, 0xa4, 0x5c, 0x03, 0x4e, 0x02};
-  writeBytesChecksum(31, values);
+  return(i == N_COMMANDS ? NO_COMMAND :
+         commandSlot(commands[i].command) == slot ? i : slotCommand(slot, i + 1));
 }
 
-int main()
+// True if no command from i onward shares a slot with a later one
+constexpr bool slotsUnique(uint8 i = 0, uint8 j = 1)
 {
-  init(); // Arduino library init
-  setup(); // Pin setup
+  return(i == N_COMMANDS ? true :
+         j == N_COMMANDS ? slotsUnique(i + 1, i + 2) :
+         commandSlot(commands[i].command) != commandSlot(commands[j].command) &&
+         slotsUnique(i, j + 1));
+}
 
-  // Sit and wait for the sleep pin to go high (camera is turned on)
-  while(digitalRead(SLEEP) == 0){}
+static_assert(slotsUnique(), "Two commands share a slot; change commandSlot()");
+
+#define SLOTS4(n) slotCommand(n), slotCommand(n + 1), slotCommand(n + 2), slotCommand(n + 3)
+const uint8 commandIndex[COMMAND_SLOTS] PROGMEM = {
+  SLOTS4(0), SLOTS4(4), SLOTS4(8), SLOTS4(12),
+  SLOTS4(16), SLOTS4(20), SLOTS4(24), SLOTS4(28),
+  SLOTS4(32), SLOTS4(36), SLOTS4(40), SLOTS4(44),
+  SLOTS4(48), SLOTS4(52), SLOTS4(56), SLOTS4(60)
+};
+
+/* Build with -DREPLAY to answer queries and standby requests from a trace
+ * recorded by fakebody (see recorder.h) instead of the arrays above.  Each
+ * command gets the next good response to the same command in the trace,
+ * going round again at the end, so a recording plays back bit for bit in
+ * the order it happened.  Commands the trace never saw are answered as
+ * usual. */
+#ifdef REPLAY
+#include "replaytrace.h"
+
+uint16 replayNext = 0; // Offset of the record after the last one played
+uint8 replayMissing[COMMAND_SLOTS / 8]; // Command slots with nothing in the trace
+
+// Starts sending the recorded response to a command, if there is one
+bool replay(uint32 commandBytes)
+{
+  uint8 slot = commandSlot(commandBytes);
+  if(replayMissing[slot >> 3] & (1 << (slot & 7))){
+    return(false);
+  }
 
-  // Check that the body ACK pin is high
-  waitBodyHigh();
+  uint16 offset = replayNext;
+  do{
+    uint8 length = pgm_read_byte(&replayTrace[offset]);
+    const uint8* record = &replayTrace[offset + 1];
+    offset += length + 1;
+    if(offset >= sizeof(replayTrace)){
+      offset = 0;
+    }
 
-  // Pulse our ACK pin to let the body know we're awake
-  digitalWrite(LENS_ACK, 1);
-  delay(10);
-  digitalWrite(LENS_ACK, 0);
+    uint32 recorded = 0;
+    for(uint8 i = 0; i < 4; i++){
+      recorded |= (uint32)pgm_read_byte(&record[RECORD_HEADER - 4 + i]) << (8 * i);
+    }
+    if(pgm_read_byte(&record[0]) == RECORD_OK && recorded == commandBytes){
+      replayNext = offset;
+      beginSend_P(&record[RECORD_HEADER], length - RECORD_HEADER);
+      return(true);
+    }
+  } while(offset != replayNext);
 
-  while(1){
-    // Wait until the body ACK goes high
-    waitBodyRise();
+  replayMissing[slot >> 3] |= (1 << (slot & 7));
+  return(false);
+}
+#endif
 
-    // Ready
-    digitalWrite(LENS_ACK, 1);
+/* Sets up the response to a command.  Runs with interrupts off.  The
+ * table is in program memory, so the entry is copied out first. */
+void dispatch()
+{
+  uint32 commandBytes = commandFromBytes(command);
+  uint8 index = pgm_read_byte(&commandIndex[commandSlot(rx.checksum)]);
+  LensCommand c;
+  if(index != NO_COMMAND){
+    memcpy_P(&c, &commands[index], sizeof(c));
+  }
 
-    // Read four bytes
-    uint32 commandBytes;
-    readBytesChecksum(4, (uint8*)&commandBytes);
+  if(index != NO_COMMAND && c.command == commandBytes){
+    commandHits[index]++;
+#ifdef REPLAY
+    if((c.handler == sendResponse || c.handler == sendStandby) && replay(commandBytes)){
+      return;
+    }
+#endif
+    c.handler(c);
+  }
+  else{
+    // Printing takes far too long to do here; leave it to the main loop
+    unknownHits++;
+    if((uint8)(unknownHead - unknownTail) < UNKNOWN_LOG){
+      UnknownCommand& u = unknownLog[unknownHead & (UNKNOWN_LOG - 1)];
+      u.command = commandBytes;
+      u.us = micros();
+      unknownHead++; // Only now can the main loop see it
+    }
+    else{
+      unknownLost++;
+    }
+    state = IDLE;
+  }
 
-    waitBodyFall();
-    digitalWrite(LENS_ACK, 0);
+  if(state == IDLE){
+    spiDisable();
+    profileFinish();
+  }
+}
 
-    switch(commandBytes){
-    // Note that all of the case values have the bytes in reverse order from
-    // the way they are transmitted.
-    case 0x0000f2b0:
-      // There's a extra fall-rise sequence for some reason
-      waitBodyRise();
-      digitalWrite(LENS_ACK, 1);
-      delay(500);
-
-      digitalWrite(LENS_ACK, 0);
-      waitBodyLow(); // Falling edge happens very fast
-      digitalWrite(LENS_ACK, 1);
-      waitBodyRise();
-
-      writeByte(0x00);
+/* Moves the state machine along for the current level of BODY_ACK.  This is
+ * called on every change, and also after anything which starts waiting on
+ * BODY_ACK, since the body may have got there before us. */
+void bodyAckChanged()
+{
+  LensState entered;
+  do{
+    entered = state;
+    bool high = bodyAckHigh();
+
+    switch(state){
+    case IDLE:
+      if(high){
+        // Start of a command.  Turning the SPI on here resynchronizes it.
+        spiSlaveEnable();
+        spiInterruptEnable();
+        profileStart();
+        inCommand = true;
+        frameBeginCommand(rx, command);
+        state = RX_BYTE;
+        setLensAck(HIGH); // Ready
+      }
       break;
 
-    case 0x0000f6c0:
-    {
-      uint8 sendBytes[5] = {0x00, 0x0a, 0x10, 0xc4, 0x09};
-      writeBytesChecksum(5, sendBytes);
-    }
+    case PACKET_START:
+      if(high){
+        profileMark(PHASE_HANDOFF);
+        frameBeginReceive(rx, packet, sizeof(packet));
+        state = RX_BYTE;
+        setLensAck(HIGH); // Ready
+      }
       break;
 
-    case 0x0001f5a0:
-      // A0 F5 01 00 is followed by dropping the clock pin for a ms.  This
-      // ruins the SPI hardware synchronization, so reset it here.
-      // There is no response for this command.
-      SPCR = 0;
-      while(!(CLK_PIN & CLK_HIGH)){} // Wait for clock to be high again
-      //delayMicroseconds(10); // TODO: There must be a better way.
-      Serial.write("reset!");
-      SPCR = 0;
-      SPCR = (1<<SPE) | (1<<DORD) | (1<<CPOL) | (1<<CPHA);
+    case RX_CHECKSUM:
+      if(!high){
+        sendByte(frameNextByte(rx));
+        setLensAck(HIGH); // Ready
+      }
       break;
 
-    case 0x0000f9c1:
-      {
-        // Information contained in here:
-        // Aperture limits, focus limits, zoom?
-        // Firmware version
-        // Vendor
-        // # bytes, bytes, checksum
-        uint8 sendBytes[21] = {0x00, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x41,
-                                0x41, 0x42, 0x32, 0x32, 0x33, 0x34, 0x36, 0x35,
-                                0x00, 0x00, 0x00, 0x01, 0x11};
-        writeBytesChecksum(21, sendBytes);
+    case TX_NEXT:
+      if(!high){
+        loadNext();
       }
       break;
 
-    case 0x0000f060:
-    {
-      uint8 bytes[5];
-      waitBodyHigh();
-      digitalWrite(LENS_ACK, 1);
+    case HANDSHAKE_RISE:
+      if(high){
+        setLensAck(HIGH);
+        if(handshakeDelay){
+          handshakeStart = millis();
+          state = HANDSHAKE_DELAY;
+        }
+        else{
+          // Long enough for the body to see, since it's waiting for the fall
+          delayMicroseconds(ACK_PULSE_US);
+          setLensAck(LOW);
+          state = HANDSHAKE_FALL;
+        }
+      }
+      break;
 
-      // The first byte (length) isn't part of the checksum, so do it here.
-      readByte();
-      digitalWrite(LENS_ACK, 0); // Working
-      digitalWrite(LENS_ACK, 1); // Ready
+    case HANDSHAKE_FALL:
+      if(!high){
+        sendByte(0x00);
+        setLensAck(HIGH);
+      }
+      break;
 
-      readBytesChecksum(0x05, bytes);
-    }
+    case END:
+      if(!high){
+        setLensAck(LOW);
+        releaseData();
+        if(inCommand){
+          profileMark(PHASE_CHECKSUM);
+          inCommand = false;
+          dispatch();
+        }
+        else{
+          profileMark(PHASE_PAYLOAD);
+          spiDisable();
+          standbyRelease(standby);
+          if(firmwareSending){
+            firmwareUs = micros() - firmwareStart;
+            firmwarePending = true;
+            firmwareSending = false;
+          }
+          state = IDLE;
+          profileFinish();
+        }
+      }
       break;
 
-    // Standby packet
-    case 0x060180c1: // E-PL1
-    case 0x020180c1: // E-P1
-      standbyPacket();
+    default:
       break;
+    }
+  } while(state != entered);
+}
 
-    // Extended packets - aperture, focus, etc.
-    case 0xfe068060:
-    case 0x02fe8060:
-    {
-      uint8 bytes[10];
-      waitBodyHigh();
-      digitalWrite(LENS_ACK, 1);
+ISR(BODY_ACK_vect)
+{
+  busActivity++;
+  bodyAckChanged();
+}
 
-      // The first byte (length) isn't part of the checksum, so do it here.
-      readByte();
-      digitalWrite(LENS_ACK, 0); // Working
-      digitalWrite(LENS_ACK, 1); // Ready
+ISR(SPI_STC_vect)
+{
+  uint8 value = spiRead();
+  busActivity++;
+
+#ifdef DROP_TEST
+  static uint16 received = 0;
+  if(++received == DROP_EVERY){
+    received = 0;
+    return;
+  }
+#endif
+
+  switch(state){
+  case RX_BYTE:
+    if(framePutByte(rx, value) == FRAME_TOO_LONG){
+      // Leave the body hanging rather than overrun the buffer
+      droppedPackets++;
+      setLensAck(LOW);
+      spiDisable();
+      state = IDLE;
+    }
+    else if(frameAtChecksum(rx)){
+      // Note: No ready here, we're waiting for the body to drop
+      setLensAck(LOW); // Working
+      state = RX_CHECKSUM;
+      if(inCommand){
+        profileMark(PHASE_COMMAND);
+      }
+      else if(onPacket){
+        onPacket();
+      }
+    }
+    else{
+      pulseAck();
+      if(rx.index == 2 && !inCommand){
+        profileMark(PHASE_LENGTH);
+      }
+    }
+    break;
 
-      readBytesChecksum(0x0a, bytes);
+  case TX_BYTE:
+    state = txLast ? END : TX_NEXT;
+    if(tx.index == 2 && !txLast){
+      profileMark(PHASE_LENGTH);
     }
-      break;
+    break;
 
-    case 0x020388b1:
-      // Why is our ack line low here?
-      waitBodyHigh();
-      digitalWrite(LENS_ACK, 1);
-      digitalWrite(LENS_ACK, 0);
-      waitBodyLow();
-      digitalWrite(LENS_ACK, 1);
-      writeByte(0x00);
-      break;
+  default:
+    break;
+  }
 
-    case 0x0000f0c3:
-      /*// Appears to be some kind of firmware dump
-        waitBodyLow();
-        digitalWrite(LENS_ACK, 0);
-        digitalWrite(LENS_ACK, 1);
-        writeByte(0xBF);
-
-        waitBodyLow();
-        digitalWrite(LENS_ACK, 0);
-        digitalWrite(LENS_ACK, 1);
-        writeByte(0x08);
-
-      for(uint16 i = 0; i < 0x08BF; i++){
-        waitBodyLow();
-        digitalWrite(LENS_ACK, 0);
-        digitalWrite(LENS_ACK, 1);
-        writeByte(0x00);
-      }
-      */
+  bodyAckChanged();
+}
+
+/* Drops whatever transaction is in progress and goes back to waiting for
+ * a command.  Runs with interrupts off. */
+void abandonTransaction()
+{
+  spiDisable();
+  releaseData();
+  setLensAck(LOW);
+  profileDiscard();
+  standbyRelease(standby);
+  firmwareSending = false;
+  state = IDLE;
+}
 
-    case 0x0000f3c2:
+/* Prints the unknown commands logged since last time, oldest first.  The
+ * entries are only read here, so the interrupts can keep adding more. */
+void reportUnknown()
+{
+  while(unknownTail != unknownHead){
+    const UnknownCommand& u = unknownLog[unknownTail & (UNKNOWN_LOG - 1)];
+    Serial.print(F("Unknown: "));
+    Serial.print(u.command, HEX);
+    Serial.print(F(" at "));
+    Serial.print(u.us);
+    Serial.println(F(" us"));
+    unknownTail++;
+  }
 
-      /*
-    //case 0x0000f3cf:
-      {
-      uint8 sendBytes[4] = {0x00, 0x00, 0x00, 0x00};
-      writeBytesChecksum(4, sendBytes);
-      }
-      break;
-      */
-    default:
-      Serial.print("Unknown: ");
-      Serial.println(commandBytes, HEX);
-    }
-    waitBodyLow(); // We may have missed the edge, just wait for low
-    digitalWrite(LENS_ACK, 0);
+  if(unknownLost){
+    noInterrupts();
+    uint16 lost = unknownLost;
+    unknownLost = 0;
+    interrupts();
+    Serial.print(F("Unknown commands not logged: "));
+    Serial.println(lost);
+  }
+}
 
-    // Set the data pin low and let go of it
-    digitalWrite(DATA_MISO, 0);
-    pinMode(DATA_MISO, INPUT);
+// Prints how many times each command has come in, which is how much of the
+// protocol the body has used
+void coverageReport()
+{
+  for(uint8 i = 0; i < N_COMMANDS; i++){
+    noInterrupts();
+    uint32 hits = commandHits[i];
+    interrupts();
+    Serial.print(pgm_read_dword(&commands[i].command), HEX);
+    Serial.print(F(": "));
+    Serial.println(hits);
   }
-/*
+  noInterrupts();
+  uint32 hits = unknownHits;
+  interrupts();
+  Serial.print(F("Unknown: "));
+  Serial.println(hits);
+}
 
+int main()
+{
+  init(); // Arduino library init
+  setup(); // Pin setup
 
+  // The body can turn us off at any time to start again from scratch
+  while(1){
+    // Sit and wait for the sleep pin to go high (camera is turned on)
+    while(digitalRead(SLEEP) == 0){}
 
-  readBytesChecksum(4);
+    // Check that the body ACK pin is high
+    while(!bodyAckHigh()){}
 
-  waitBodyLow();
-  digitalWrite(LENS_ACK, 0);
-  waitBodyHigh();
-  digitalWrite(LENS_ACK, 1);
+    // Pulse our ACK pin to let the body know we're awake
+    digitalWrite(LENS_ACK, 1);
+    delay(10);
+    digitalWrite(LENS_ACK, 0);
+    while(bodyAckHigh()){}
+
+    // From here on the interrupts do the talking
+    bodyModel = BODY_MODELS;
+#ifdef PROFILE
+    tickTimerStart();
+#endif
+    standbySnapshotBegin(standby, standbyInitial);
+    lensModelBegin(standbyView(standby.bytes[0]));
+    bodyAckInterruptEnable();
+
+    uint8 lastActivity = busActivity;
+    uint32 lastActive = micros();
+
+    while(digitalRead(SLEEP)){
+      // handshakeStart is set from the interrupt, so keep it out while we look
+      noInterrupts();
+      if(state == HANDSHAKE_DELAY && millis() - handshakeStart >= handshakeDelay){
+        setLensAck(LOW);
+        state = HANDSHAKE_FALL;
+        bodyAckChanged();
+      }
 
-  // The body drops the clock for some unknown reason, ruining the
-  // SPI line synchronization.  Reset the hardware to fix it.
+      // Give up on a transaction which has stopped moving.  The long pause
+      // in the power-up handshake is ours, so it doesn't count.
+      if(state == IDLE || state == HANDSHAKE_DELAY || busActivity != lastActivity){
+        lastActivity = busActivity;
+        lastActive = micros();
+      }
+      else if(micros() - lastActive > TRANSACTION_TIMEOUT_US){
+        abandonTransaction();
+        abandoned++;
+      }
+      interrupts();
 
-  readBytesChecksum(4);
+      if(state == IDLE){
+        reportUnknown();
+      }
 
+      if(droppedPackets){
+        noInterrupts();
+        uint8 dropped = droppedPackets;
+        droppedPackets = 0;
+        interrupts();
+        Serial.print(F("Packets too long: "));
+        Serial.println(dropped);
+      }
 
-  waitBodyLow();
-  digitalWrite(LENS_ACK, 0);
-  waitBodyHigh();
-  digitalWrite(LENS_ACK, 1);
+      // Keep the standby packet moving with the lens
+      if(standbyBeginUpdate(standby)){
+        lensModelUpdate(standby);
+        standbyPublish(standby);
+      }
 
-  readBytesChecksum(4);
+      LensActuator moved;
+      uint16 position;
+      uint32 ms;
+      while(lensModelArrived(moved, position, ms)){
+        Serial.print(moved == ACTUATOR_FOCUS ? F("Focus at ") : F("Aperture at "));
+        Serial.print(position);
+        Serial.print(F(" after "));
+        Serial.print(ms);
+        Serial.println(F(" ms"));
+      }
 
-  // The body expects some bytes here...
-  writeBytesChecksum(2, sendBytes2);
+      if(bodyPending){
+        bodyPending = false;
+        Serial.print(F("Body: "));
+        if(bodyModel == BODY_MODELS){
+          Serial.println(F("unknown"));
+        }
+        else{
+          char name[sizeof(bodyProfiles[0].name)];
+          memcpy_P(name, bodyProfiles[bodyModel].name, sizeof(name));
+          Serial.println(name);
+        }
+      }
 
-  waitBodyLow();
-  digitalWrite(LENS_ACK, 0);
-  waitBodyHigh();
-  digitalWrite(LENS_ACK, 1);
+      if(firmwarePending){
+        noInterrupts();
+        uint32 us = firmwareUs;
+        firmwarePending = false;
+        interrupts();
+        Serial.print(F("Firmware dump: "));
+        Serial.print(sizeof(firmwareDump));
+        Serial.print(F(" bytes in "));
+        Serial.print(us);
+        Serial.print(F(" us, "));
+        // No floats: the size of the dump times a million still fits in 32 bits
+        Serial.print((uint32)sizeof(firmwareDump) * 1000000UL / (us ? us : 1));
+        Serial.println(F(" bytes/s"));
+      }
 
-  readBytesChecksum(4);
+      if(abandoned){
+        noInterrupts();
+        uint8 n = abandoned;
+        abandoned = 0;
+        interrupts();
+        Serial.print(F("Transactions abandoned: "));
+        Serial.println(n);
+      }
 
-  waitBodyLow();
-  digitalWrite(LENS_ACK, 0);
-  delay(10);
-  digitalWrite(LENS_ACK, 1);
+      // Send a 'p' to print the profile or a 'c' to clear it (with
+      // -DPROFILE), an 'h' for the command counts, or an 'm' for the SRAM
+      // usage
+      profileUpdate();
+      if(Serial.available()){
+        uint8 c = Serial.read();
+        if(c == 'p'){ profileDump(); }
+        else if(c == 'c'){ profileClear(); }
+        else if(c == 'h'){ coverageReport(); }
+        else if(c == 'm'){ memoryReport(); }
+      }
+    }
 
-  while(1){
-    //standbyPacket();
+    // Turned off
+    bodyAckInterruptDisable();
+    noInterrupts();
+    abandonTransaction();
+    interrupts();
   }
-  */
+
   return(0);
 }
@@ -0,0 +1,151 @@
+/* focus.cpp
+ * Closed-loop focus moves.  See focus.h.
+ */
+
+#include "focus.h"
+#include "hal.h"
+
+enum FocusState {
+  FOCUS_IDLE, // No move in progress
+  FOCUS_SEND, // A command is ready to go
+  FOCUS_WAIT, // For the commands we've handed out to reach the lens
+  FOCUS_MOVING // Watching the lens get there
+};
+
+static FocusState state = FOCUS_IDLE;
+static uint16 target;
+static int32 commanded; // Position we last told the lens
+static uint8 inFlight = 0; // Commands handed out and not yet sent
+static bool started; // Once the first command has been handed out
+static int8 direction; // Of travel, from where the move started
+static uint16 lastPosition;
+static uint8 still; // Frames the position hasn't changed for
+static bool within; // In tolerance as of the last frame
+static uint32 startUs;
+static uint32 withinUs; // When it last came within tolerance
+
+static FocusResult result;
+static bool finished = false; // A result is waiting for focusFinished()
+
+static void finish(bool settled, uint16 position, uint32 now)
+{
+  result.target = target;
+  result.position = position;
+  result.settleUs = (settled ? withinUs : now) - startUs;
+  result.settled = settled;
+  finished = true;
+  state = FOCUS_IDLE;
+}
+
+/* Starts a move to a focus position, as in the standby packet.  Any move
+ * already in progress is dropped without a result. */
+void focusMoveTo(uint16 to)
+{
+  target = to;
+  commanded = to;
+  started = false;
+  result.overshoot = 0;
+  result.corrections = 0;
+  state = FOCUS_SEND;
+}
+
+bool focusBusy()
+{
+  return(state != FOCUS_IDLE);
+}
+
+/* Moves the controller along with the latest standby response.  Call once
+ * a frame, with a packet that arrived intact.  Returns true if a focus
+ * command should go to the lens, with the position to send. */
+bool focusUpdate(StandbyView v, int32& command)
+{
+  if(state == FOCUS_IDLE || state == FOCUS_WAIT){
+    return(false);
+  }
+
+  uint16 position = standbyFocusPosition(v);
+  uint32 now = micros();
+  if(!started){
+    started = true;
+    startUs = now;
+    direction = target > position ? 1 : target < position ? -1 : 0;
+    lastPosition = position;
+    still = 0;
+    within = false;
+  }
+  else if(now - startUs > FOCUS_TIMEOUT_MS * 1000UL){
+    finish(false, position, now);
+    return(false);
+  }
+
+  if(state == FOCUS_SEND){
+    command = commanded;
+    inFlight++;
+    state = FOCUS_WAIT;
+    return(true);
+  }
+
+  int32 error = (int32)target - position;
+  int32 past = -direction * error;
+  if(past > result.overshoot){
+    result.overshoot = past;
+  }
+  still = position == lastPosition ? still + 1 : 0;
+  lastPosition = position;
+
+  bool in = error <= FOCUS_TOLERANCE && error >= -FOCUS_TOLERANCE;
+  if(in && !within){
+    withinUs = now;
+  }
+  within = in;
+
+  if(still < FOCUS_STILL_FRAMES){
+    return(false); // Still on its way
+  }
+  if(within){
+    finish(true, position, now);
+    return(false);
+  }
+  if(result.corrections == FOCUS_MAX_CORRECTIONS){
+    finish(false, position, now);
+    return(false);
+  }
+
+  // Stopped in the wrong place, so make up the difference
+  result.corrections++;
+  commanded += error;
+  command = commanded;
+  inFlight++;
+  still = 0;
+  state = FOCUS_WAIT;
+  return(true);
+}
+
+/* Says whether a command from focusUpdate() got to the lens intact, or
+ * never went out at all.  A lost command is sent again. */
+void focusSent(bool ok)
+{
+  if(inFlight){
+    inFlight--;
+  }
+  if(state == FOCUS_WAIT || state == FOCUS_MOVING){
+    if(!ok){
+      state = FOCUS_SEND;
+    }
+    else if(!inFlight){
+      state = FOCUS_MOVING;
+      still = 0;
+    }
+  }
+}
+
+// Returns true if a move has finished since last time, with how it went
+bool focusFinished(FocusResult& r)
+{
+  if(!finished){
+    return(false);
+  }
+  r = result;
+  finished = false;
+  return(true);
+}
@@ -0,0 +1,58 @@
+/* focus.h
+ * Closed-loop focus moves for fakebody.
+ *
+ * The focus command takes a position, but nothing says the lens ends up
+ * exactly there, so each move is checked against the focus position in the
+ * standby packet (STANDBY_FOCUS_POSITION) every frame.  Once the lens has
+ * stopped moving, if it's still out by more than FOCUS_TOLERANCE steps, the
+ * command is corrected by the error and sent again.  The command is taken
+ * to be absolute, as fakelens has it, so a correction adds whatever offset
+ * the lens has between what it's told and what it reports.
+ *
+ * The controller only works out what to send; fakebody queues it as an
+ * extended packet and says whether it got to the lens with focusSent(), so
+ * that a command lost on the bus is sent again rather than corrected for.
+ *
+ * Every move ends with a result: how long it took to settle within the
+ * tolerance, counted from the first command to the first frame that
+ * stayed there (so to within a frame), how far it went past the target on
+ * the way, and how many corrections it needed.
+ */
+
+#ifndef FOCUS_H_
+#define FOCUS_H_
+
+#include "typedef.h"
+#include "standby.h"
+
+// Steps either side of the target that count as there
+#define FOCUS_TOLERANCE 2
+
+// Frames in a row without the position changing before the lens counts as stopped
+#define FOCUS_STILL_FRAMES 2
+
+// A move gives up after this many corrections, or this long
+#define FOCUS_MAX_CORRECTIONS 4
+#define FOCUS_TIMEOUT_MS 2000
+
+// Set with the corrections in a TELEMETRY_FOCUS frame if the move settled
+#define FOCUS_SETTLED 0x80
+
+struct FocusResult
+{
+  uint16 target;
+  uint16 position; // Where it stopped
+  uint32 settleUs; // From the first command to the first frame within
+                   // tolerance, or to when it gave up
+  uint16 overshoot; // Furthest past the target in the direction of travel, in steps
+  uint8 corrections;
+  bool settled; // False if it gave up
+};
+
+void focusMoveTo(uint16 target);
+bool focusBusy();
+bool focusUpdate(StandbyView v, int32& command);
+void focusSent(bool ok);
+bool focusFinished(FocusResult& r);
+
+#endif /* FOCUS_H_ */
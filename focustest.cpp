@@ -0,0 +1,140 @@
+/* focustest.cpp
+ * Host-side check of the closed-loop focus controller in focus.cpp.  Each
+ * frame's standby packet is made up here, with the focus position a lens
+ * that overshoots, stalls or loses a command would report, and the clock
+ * is moved on by a frame each time.  Build and run it on the host (see the
+ * README); it prints each check that fails, and exits with 1 if any did.
+ */
+
+#include <stdio.h>
+#include "focus.h"
+#include "hal.h"
+
+static int failures = 0;
+
+#define CHECK(got, expected) check(#got, (got), (expected))
+
+static void check(const char* what, unsigned long got, unsigned long expected)
+{
+  if(got != expected){
+    printf("%s: got 0x%lx, expected 0x%lx\n", what, got, expected);
+    failures++;
+  }
+}
+
+#define FRAME_US 16667
+
+static unsigned long now = 0;
+unsigned long micros() { return(now); }
+
+static uint8 payload[STANDBY_BYTES];
+static StandbyView v = standbyView(payload);
+
+/* Runs the controller on a frame whose standby packet puts the focus at
+ * position.  Returns the command it sends, or -1 if none. */
+static int32 frame(uint16 position)
+{
+  now += FRAME_US;
+  standbySetField16(v, STANDBY_FOCUS_POSITION, position);
+  int32 command;
+  return(focusUpdate(v, command) ? command : -1);
+}
+
+int main()
+{
+  FocusResult r;
+
+  // A lens that goes 20 steps past the target and stops there gets one
+  // correction, and then settles
+  focusMoveTo(500);
+  CHECK(focusBusy(), true);
+  CHECK(frame(400), 500);
+  CHECK(frame(400), -1); // Nothing more until it has gone
+  focusSent(true);
+  CHECK(frame(450), -1);
+  CHECK(frame(520), -1);
+  CHECK(frame(520), -1);
+  CHECK(frame(520), 480); // Stopped for FOCUS_STILL_FRAMES, and 20 out
+  focusSent(true);
+  CHECK(frame(500), -1);
+  CHECK(frame(500), -1);
+  CHECK(focusFinished(r), false);
+  CHECK(frame(500), -1);
+  CHECK(focusBusy(), false);
+  CHECK(focusFinished(r), true);
+  CHECK(r.settled, true);
+  CHECK(r.target, 500);
+  CHECK(r.position, 500);
+  CHECK(r.corrections, 1);
+  CHECK(r.overshoot, 20);
+  CHECK(r.settleUs, 6 * FRAME_US); // From the first command to the first frame at 500
+  CHECK(focusFinished(r), false);
+
+  // Within FOCUS_TOLERANCE counts as there, with no correction
+  focusMoveTo(600);
+  CHECK(frame(500), 600);
+  focusSent(true);
+  CHECK(frame(598), -1);
+  CHECK(frame(598), -1);
+  CHECK(frame(598), -1);
+  CHECK(focusFinished(r), true);
+  CHECK(r.settled, true);
+  CHECK(r.corrections, 0);
+  CHECK(r.overshoot, 0);
+
+  // A command lost on the bus is sent again as it was, not corrected for
+  focusMoveTo(700);
+  CHECK(frame(600), 700);
+  focusSent(false);
+  CHECK(frame(600), 700);
+  focusSent(true);
+  CHECK(frame(700), -1);
+  CHECK(frame(700), -1);
+  CHECK(frame(700), -1);
+  CHECK(focusFinished(r), true);
+  CHECK(r.settled, true);
+  CHECK(r.corrections, 0);
+
+  // A lens that stalls short of the target is pushed further each time,
+  // and given up on after FOCUS_MAX_CORRECTIONS
+  focusMoveTo(900);
+  CHECK(frame(700), 900);
+  focusSent(true);
+  CHECK(frame(800), -1);
+  int32 expected = 900;
+  for(uint8 i = 0; i <= FOCUS_MAX_CORRECTIONS; i++){
+    CHECK(frame(800), -1);
+    expected += 100;
+    CHECK(frame(800), i < FOCUS_MAX_CORRECTIONS ? expected : -1);
+    focusSent(true);
+  }
+  CHECK(focusBusy(), false);
+  CHECK(focusFinished(r), true);
+  CHECK(r.settled, false);
+  CHECK(r.position, 800);
+  CHECK(r.corrections, FOCUS_MAX_CORRECTIONS);
+
+  // So is one that never stops, after FOCUS_TIMEOUT_MS
+  focusMoveTo(200);
+  CHECK(frame(800), 200);
+  focusSent(true);
+  uint16 position = 800;
+  uint16 frames = 1;
+  while(focusBusy() && frames < 1000){
+    position ^= 1; // Jittering, so never still
+    CHECK(frame(position), -1);
+    frames++;
+  }
+  CHECK(focusFinished(r), true);
+  CHECK(r.settled, false);
+  CHECK(r.corrections, 0);
+  // The first frame more than FOCUS_TIMEOUT_MS after the first command
+  CHECK(frames, FOCUS_TIMEOUT_MS * 1000UL / FRAME_US + 2);
+
+  if(failures){
+    printf("%d checks failed\n", failures);
+    return(1);
+  }
+  printf("All focus checks passed\n");
+  return(0);
+}
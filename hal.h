@@ -0,0 +1,234 @@
+/* hal.h
+ * Pin and SPI abstraction for the MFT bus lines.  On the Arduino Mega 2560
+ * these compile down to single register accesses; on a Linux host (built
+ * with -DMFT_HOST) they go to the bus simulator in sim.cpp instead, so the
+ * lens and body code can run against each other without any hardware.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include "typedef.h"
+
+#ifdef MFT_HOST
+#include "sim.h"
+#else
+#include "Arduino.h"
+#include <avr/eeprom.h>
+#endif
+
+#include "common.h"
+#include "progmem.h"
+
+// Clock rates for spiMasterEnable(), encoded as SPI2X:SPR1:SPR0
+#define SPI_CLOCK_DIV2 0x04 // 8 MHz
+#define SPI_CLOCK_DIV4 0x00
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_CLOCK_DIV16 0x01
+#define SPI_CLOCK_DIV32 0x06 // 500 kHz, the rate the camera uses
+#define SPI_CLOCK_DIV64 0x02
+#define SPI_CLOCK_DIV128 0x03
+
+// The rate of one of the above, from the 16 MHz CPU clock
+inline uint16 spiClockKhz(uint8 clock)
+{
+  static const uint8 dividers[4] PROGMEM = {4, 16, 64, 128}; // SPR1:SPR0
+  return(16000 / (pgm_read_byte(&dividers[clock & 0x03]) >> ((clock >> 2) & 1)));
+}
+
+#ifndef MFT_HOST
+
+// Read the current level of the bus lines
+inline bool lensAckHigh() { return LENS_ACK_PIN & LENS_ACK_HIGH; }
+inline bool bodyAckHigh() { return BODY_ACK_PIN & BODY_ACK_HIGH; }
+inline bool clkHigh() { return CLK_PIN & CLK_HIGH; }
+inline bool dataHigh() { return DATA_PIN & DATA_HIGH; }
+
+// Drive the bus lines.  These only have an effect if the pin is an output.
+inline void setLensAck(bool high)
+{
+  if(high){ LENS_ACK_PORT |= LENS_ACK_HIGH; }
+  else{ LENS_ACK_PORT &= LENS_ACK_LOW; }
+}
+
+inline void setBodyAck(bool high)
+{
+  if(high){ BODY_ACK_PORT |= BODY_ACK_HIGH; }
+  else{ BODY_ACK_PORT &= BODY_ACK_LOW; }
+}
+
+inline void setClk(bool high)
+{
+  if(high){ CLK_PORT |= CLK_HIGH; }
+  else{ CLK_PORT &= CLK_LOW; }
+}
+
+inline void setData(bool high)
+{
+  if(high){ DATA_PORT |= DATA_HIGH; }
+  else{ DATA_PORT &= DATA_LOW; }
+}
+
+inline void setShutter(bool high)
+{
+  if(high){ SHUTTER_PORT |= SHUTTER_HIGH; }
+  else{ SHUTTER_PORT &= SHUTTER_LOW; }
+}
+
+// Take or relinquish control of the shared data line and the clock
+inline void driveData() { DATA_DIR |= DATA_WRITE; }
+inline void releaseData() { DATA_DIR &= DATA_READ; }
+inline void driveClk() { DATA_DIR |= CLK_WRITE; }
+
+// The SPI master shifts out on MOSI instead, and its MISO is always an input
+inline void driveMosi() { DATA_DIR |= DATA_MOSI_WRITE; }
+inline void releaseMosi() { DATA_DIR &= DATA_MOSI_READ; }
+
+/* Turns on the SPI hardware as a slave.
+ * SPE - Enable
+ * DORD - Set data order to LSB-first
+ * Slave mode (Master bit is not set)
+ * CPOL - Set clock polarity to "normally high"
+ * CPHA - Set to read on trailing (rising) edge */
+inline void spiSlaveEnable() { SPCR = (1<<SPE) | (1<<DORD) | (1<<CPOL) | (1<<CPHA); }
+inline void spiDisable() { SPCR = 0x00; }
+
+/* Turns on the SPI hardware as a master, with the same format as the slave.
+ * SS must already be an output, or pulling it low drops us back to slave. */
+inline void spiMasterEnable(uint8 clock)
+{
+  SPCR = (1<<SPE) | (1<<DORD) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (clock & 0x03);
+  if(clock & 0x04){ SPSR |= (1<<SPI2X); }
+  else{ SPSR &= ~(1<<SPI2X); }
+}
+
+// SPIE - Interrupt on transfer complete.  Call after spiSlaveEnable().
+inline void spiInterruptEnable() { SPCR |= (1<<SPIE); }
+inline void spiInterruptDisable() { SPCR &= ~(1<<SPIE); }
+
+/* Port L has no pin change interrupts, so BODY_ACK is also jumpered to
+ * BODY_ACK_INT on port B, whose changes interrupt on PCINT0_vect. */
+#define BODY_ACK_vect PCINT0_vect
+inline void bodyAckInterruptEnable()
+{
+  PCMSK0 |= (1<<PCINT4);
+  PCIFR = (1<<PCIF0); // Clear anything left over
+  PCICR |= (1<<PCIE0);
+}
+inline void bodyAckInterruptDisable() { PCICR &= ~(1<<PCIE0); }
+
+/* Timer 1 free-running at F_CPU / 8, for timing things that are too short or
+ * too frequent for micros().  The Arduino core leaves timer 1 alone. */
+#define TICKS_PER_US 2
+inline void tickTimerStart() { TCCR1A = 0; TCCR1B = (1<<CS11); }
+inline uint16 ticks() { return(TCNT1); }
+
+/* Interrupts when the tick count reaches a given value, on TICK_ALARM_A_vect
+ * or TICK_ALARM_B_vect.  Setting one clears anything left pending from
+ * before.  The output compare pins stay disconnected. */
+#define TICK_ALARM_A_vect TIMER1_COMPA_vect
+#define TICK_ALARM_B_vect TIMER1_COMPB_vect
+inline void setTickAlarmA(uint16 at) { OCR1A = at; TIFR1 = (1<<OCF1A); TIMSK1 |= (1<<OCIE1A); }
+inline void setTickAlarmB(uint16 at) { OCR1B = at; TIFR1 = (1<<OCF1B); TIMSK1 |= (1<<OCIE1B); }
+inline void cancelTickAlarmA() { TIMSK1 &= ~(1<<OCIE1A); }
+inline void cancelTickAlarmB() { TIMSK1 &= ~(1<<OCIE1B); }
+
+// One pass of a loop that waits on something only an interrupt changes
+inline void spin() {}
+
+/* Lets any pending interrupts run, and puts the interrupt flag back as it
+ * was.  The instruction after sei always runs first, hence the nop. */
+inline void interruptWindow()
+{
+  uint8 sreg = SREG;
+  sei();
+  __asm__ __volatile__("nop");
+  SREG = sreg;
+}
+
+/* USART1 (TX1 and RX1, pins 18 and 19) driven directly, 8N1 with double
+ * speed on.  We never touch Serial1, so the Arduino core doesn't claim its
+ * interrupts. */
+inline void uart1Begin(uint32 baud)
+{
+  UBRR1 = F_CPU / 8 / baud - 1;
+  UCSR1A = (1<<U2X1);
+  UCSR1C = (1<<UCSZ11) | (1<<UCSZ10);
+  UCSR1B = (1<<TXEN1);
+}
+inline void uart1Write(uint8 value) { UDR1 = value; }
+inline void uart1InterruptEnable() { UCSR1B |= (1<<UDRIE1); }
+inline void uart1InterruptDisable() { UCSR1B &= ~(1<<UDRIE1); }
+
+// Turns on the receiver, which interrupts on USART1_RX_vect with each byte
+inline void uart1ReceiveEnable() { UCSR1B |= (1<<RXEN1) | (1<<RXCIE1); }
+inline uint8 uart1Read() { return(UDR1); }
+
+// True if a byte was lost before the one uart1Read() is about to return
+inline bool uart1Overrun() { return UCSR1A & (1<<DOR1); }
+
+/* The 4 KB EEPROM, which keeps its contents with the power off.  Updating
+ * only writes the bytes that have changed, but each of those takes 3.4 ms,
+ * so keep it away from the bus. */
+inline void eepromRead(uint16 addr, void* buf, uint16 n) { eeprom_read_block(buf, (const void*)addr, n); }
+inline void eepromUpdate(uint16 addr, const void* buf, uint16 n) { eeprom_update_block(buf, (void*)addr, n); }
+
+// Load the next byte to shift out, and fetch the last byte shifted in.
+// Accessing SPDR after SPIF is set clears SPIF.
+inline void spiWrite(uint8 value) { SPDR = value; }
+inline uint8 spiRead() { return(SPDR); }
+inline bool spiDone() { return SPSR & (1<<SPIF); }
+
+#else /* MFT_HOST */
+
+inline bool lensAckHigh() { return(simReadPin(LENS_ACK)); }
+inline bool bodyAckHigh() { return(simReadPin(BODY_ACK)); }
+inline bool clkHigh() { return(simReadPin(CLK)); }
+inline bool dataHigh() { return(simReadPin(DATA)); }
+
+inline void setLensAck(bool high) { simWritePin(LENS_ACK, high); }
+inline void setBodyAck(bool high) { simWritePin(BODY_ACK, high); }
+inline void setClk(bool high) { simWritePin(CLK, high); }
+inline void setData(bool high) { simWritePin(DATA, high); }
+inline void setShutter(bool high) { simWritePin(SHUTTER, high); }
+
+inline void driveData() { simPinOutput(DATA, true); }
+inline void releaseData() { simPinOutput(DATA, false); }
+inline void driveClk() { simPinOutput(CLK, true); }
+inline void driveMosi() { simPinOutput(DATA_MOSI, true); }
+inline void releaseMosi() { simPinOutput(DATA_MOSI, false); }
+
+inline void spiSlaveEnable() { simSpiSlaveEnable(true); }
+inline void spiDisable() { simSpiSlaveEnable(false); }
+inline void spiMasterEnable(uint8 clock) { simSpiMasterEnable(clock); }
+inline void spiInterruptEnable() { simSpiInterruptEnable(true); }
+inline void spiInterruptDisable() { simSpiInterruptEnable(false); }
+inline void bodyAckInterruptEnable() { simIrqEnable(BODY_ACK_vect, true); }
+inline void bodyAckInterruptDisable() { simIrqEnable(BODY_ACK_vect, false); }
+#define TICKS_PER_US 2
+inline void tickTimerStart() {}
+inline uint16 ticks() { return(simTicks()); }
+#define TICK_ALARM_A_vect TIMER1_COMPA_vect
+#define TICK_ALARM_B_vect TIMER1_COMPB_vect
+inline void setTickAlarmA(uint16 at) { simTickAlarm(0, at, true); }
+inline void setTickAlarmB(uint16 at) { simTickAlarm(1, at, true); }
+inline void cancelTickAlarmA() { simTickAlarm(0, 0, false); }
+inline void cancelTickAlarmB() { simTickAlarm(1, 0, false); }
+inline void spin() { simSpin(); }
+inline void interruptWindow() { simInterruptWindow(); }
+inline void uart1Begin(uint32 baud) { simUartBegin(baud); }
+inline void uart1Write(uint8 value) { simUartWrite(value); }
+inline void uart1InterruptEnable() { simUartInterruptEnable(true); }
+inline void uart1InterruptDisable() { simUartInterruptEnable(false); }
+inline void uart1ReceiveEnable() { simUartReceiveEnable(true); }
+inline uint8 uart1Read() { return(simUartRead()); }
+inline bool uart1Overrun() { return(simUartOverrun()); }
+inline void eepromRead(uint16 addr, void* buf, uint16 n) { simEepromRead(addr, (uint8*)buf, n); }
+inline void eepromUpdate(uint16 addr, const void* buf, uint16 n) { simEepromUpdate(addr, (const uint8*)buf, n); }
+inline void spiWrite(uint8 value) { simSpiWrite(value); }
+inline uint8 spiRead() { return(simSpiRead()); }
+inline bool spiDone() { return(simSpiDone()); }
+
+#endif /* MFT_HOST */
+
+#endif /* HAL_H_ */
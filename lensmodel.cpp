@@ -0,0 +1,146 @@
+/* lensmodel.cpp
+ * Focus and aperture motion for fakelens.  See lensmodel.h.
+ */
+
+#include "lensmodel.h"
+#include "hal.h"
+#include "progmem.h"
+
+// Converts a speed per second to 1/256 units per 1024 us
+#define PER_PERIOD(perSecond) ((uint32)(perSecond) * 256 * 1024 / 1000000)
+
+struct Actuator
+{
+  int32 position; // In 1/256 units
+  int32 target;
+  int32 min;
+  int32 max;
+  uint16 speed; // 1/256 units per 1024 us
+  bool moving;
+  uint32 startUs; // When the current move began
+};
+
+static Actuator actuators[LENS_ACTUATORS] = {
+  {0, 0, 0, (int32)FOCUS_STEPS << 8, PER_PERIOD(FOCUS_SPEED), false, 0},
+  {0, 0, (int32)APERTURE_MIN_AV << 8, (int32)APERTURE_MAX_AV << 8,
+   PER_PERIOD(APERTURE_SPEED), false, 0}
+};
+
+static uint32 lastUs; // Time up to which the actuators have been moved
+
+// Moves that have finished, for the main loop to report
+static volatile uint8 arrivals = 0; // Bit mask of actuators
+static uint32 arrivalUs[LENS_ACTUATORS]; // How long each move took
+
+/* Focus distance in cm at every 64 steps, assuming 1/distance goes down
+ * linearly from a 25 cm close focus to zero at infinity (0xffff). */
+static const uint16 focusDistances[17] PROGMEM = {
+  25, 27, 29, 31, 33, 36, 40, 44, 50, 57, 67, 80, 100, 133, 200, 400, 0xffff
+};
+
+static int32 clamp(const Actuator& a, int32 value)
+{
+  return(value < a.min ? a.min : value > a.max ? a.max : value);
+}
+
+// Moves everything along to the current time
+static void advance()
+{
+  uint32 now = micros();
+  uint32 elapsed = (now - lastUs) >> 10;
+  uint16 periods = elapsed > 0xffff ? 0xffff : elapsed;
+  lastUs += elapsed << 10;
+
+  for(uint8 i = 0; i < LENS_ACTUATORS; i++){
+    Actuator& a = actuators[i];
+    if(!a.moving){
+      continue;
+    }
+    int32 step = (int32)a.speed * periods;
+    if(a.position < a.target){
+      a.position = (a.target - a.position > step) ? a.position + step : a.target;
+    }
+    else{
+      a.position = (a.position - a.target > step) ? a.position - step : a.target;
+    }
+    if(a.position == a.target){
+      a.moving = false;
+      arrivalUs[i] = now - a.startUs;
+      arrivals |= (1 << i);
+    }
+  }
+}
+
+// Starts the actuators where the standby packet says they are
+void lensModelBegin(StandbyView v)
+{
+  Actuator& focus = actuators[ACTUATOR_FOCUS];
+  Actuator& aperture = actuators[ACTUATOR_APERTURE];
+  focus.position = clamp(focus, (int32)standbyFocusPosition(v) << 8);
+  aperture.position = clamp(aperture, (int32)standbyAperture(v) << 8);
+  focus.target = focus.position;
+  aperture.target = aperture.position;
+  lastUs = micros();
+}
+
+/* Sends an actuator towards a new target, in whole steps or 1/256 EV.
+ * Anything past the limits goes as far as it can. */
+void lensModelSetTarget(LensActuator i, int32 target)
+{
+  advance();
+  Actuator& a = actuators[i];
+  if(target < (a.min >> 8)){
+    target = a.min >> 8; // Also keeps the shift below from overflowing
+  }
+  else if(target > (a.max >> 8)){
+    target = a.max >> 8;
+  }
+  a.target = target << 8;
+  if(a.target != a.position){
+    a.moving = true;
+    a.startUs = micros();
+  }
+}
+
+/* Brings the focus and aperture fields of the back copy of the standby
+ * packet up to date.  Call from the main loop, between
+ * standbyBeginUpdate() and standbyPublish(). */
+void lensModelUpdate(StandbySnapshot& s)
+{
+  // The bus interrupt can change the targets, so keep it out while we move
+  noInterrupts();
+  advance();
+  uint16 focus = actuators[ACTUATOR_FOCUS].position >> 8;
+  uint16 aperture = actuators[ACTUATOR_APERTURE].position >> 8;
+  interrupts();
+
+  uint8 i = focus >> 6;
+  uint8 frac = focus & 0x3f;
+  uint16 near = pgm_read_word(&focusDistances[i]);
+  uint16 far = pgm_read_word(&focusDistances[i + 1]);
+  uint16 distance = near + (((uint32)(far - near) * frac) >> 6);
+
+  standbyPut16(s, STANDBY_FOCUS_POSITION, focus);
+  standbyPut8(s, STANDBY_RAW_FOCUS, focus >> 2);
+  standbyPut16(s, STANDBY_FOCUS_DISTANCE, distance);
+  standbyPut16(s, STANDBY_APERTURE, aperture);
+}
+
+/* Returns true if an actuator has finished a move since last time, along
+ * with where it ended up and how long it took.  Call from the main loop. */
+bool lensModelArrived(LensActuator& which, uint16& position, uint32& ms)
+{
+  bool found = false;
+  noInterrupts();
+  for(uint8 i = 0; i < LENS_ACTUATORS && !found; i++){
+    if(arrivals & (1 << i)){
+      arrivals &= ~(1 << i);
+      which = (LensActuator)i;
+      position = actuators[i].position >> 8;
+      ms = arrivalUs[i] / 1000;
+      found = true;
+    }
+  }
+  interrupts();
+  return(found);
+}
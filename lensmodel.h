@@ -0,0 +1,46 @@
+/* lensmodel.h
+ * Motion model of the focus motor and aperture actuator, so that fakelens
+ * behaves like a lens that takes time to get where the body sends it
+ * rather than jumping there.
+ *
+ * Each actuator moves towards its target at a fixed speed and stops at its
+ * limits.  Positions are kept in 1/256 units so that slow speeds still
+ * creep along, and time is counted in 1024 us "ticks" taken from micros(),
+ * which keeps everything to shifts and multiplies.  Targets are set from
+ * the bus interrupt, and the main loop moves the model along and writes
+ * the results into the standby snapshot (see standby.h).
+ *
+ * Focus is in motor steps from the close end (0) to infinity (FOCUS_STEPS),
+ * and the aperture in 1/256 EV as in standby.h.  The standby fields that
+ * depend on them are our own guess at what a real lens would report.
+ * The end of a move, and the time it took, are noticed at the first
+ * update after it happens.
+ */
+
+#ifndef LENSMODEL_H_
+#define LENSMODEL_H_
+
+#include "typedef.h"
+#include "standby.h"
+
+// Focus travel and speed.  The focus command's target is clamped to this.
+#define FOCUS_STEPS 1023
+#define FOCUS_SPEED 4000 // Steps per second
+
+// Aperture limits and speed: f/3.5 to f/22, at 16 EV per second
+#define APERTURE_MIN_AV 925
+#define APERTURE_MAX_AV 2283
+#define APERTURE_SPEED 4096 // 1/256 EV per second
+
+enum LensActuator {
+  ACTUATOR_FOCUS,
+  ACTUATOR_APERTURE,
+  LENS_ACTUATORS
+};
+
+void lensModelBegin(StandbyView v);
+void lensModelSetTarget(LensActuator a, int32 target);
+void lensModelUpdate(StandbySnapshot& s);
+bool lensModelArrived(LensActuator& a, uint16& position, uint32& ms);
+
+#endif /* LENSMODEL_H_ */
@@ -0,0 +1,58 @@
+/* lensrecord.cpp
+ * EEPROM cache of lens records.  See lensrecord.h.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "lensrecord.h"
+#include "hal.h"
+
+// A record as it sits in EEPROM
+struct LensSlot
+{
+  uint8 version;
+  LensRecord record;
+  uint8 checksum; // Of the version and the record, so that all 0xff fails
+};
+
+static uint8 slotSum(const LensSlot& s)
+{
+  const uint8* bytes = (const uint8*)&s;
+  uint8 sum = 0;
+  for(uint8 i = 0; i < offsetof(LensSlot, checksum); i++){
+    sum += bytes[i];
+  }
+  return(sum);
+}
+
+static uint16 slotAddress(const uint8* id)
+{
+  uint8 slot = (id[0] + id[1] + id[2] + id[3]) & (LENS_RECORD_SLOTS - 1);
+  return(LENS_RECORD_BASE + slot * sizeof(LensSlot));
+}
+
+/* Looks up the lens with the given identity.  Returns true and fills in r
+ * if it's there, and false if we haven't seen it (or it was pushed out by
+ * another lens with the same slot). */
+bool lensRecordLoad(const uint8* id, LensRecord& r)
+{
+  LensSlot s;
+  eepromRead(slotAddress(id), &s, sizeof(s));
+  if(s.version != LENS_RECORD_VERSION || s.checksum != (uint8)~slotSum(s) ||
+     memcmp(s.record.id, id, LENS_ID_BYTES) != 0){
+    return(false);
+  }
+  r = s.record;
+  return(true);
+}
+
+/* Saves a record, replacing whatever was in its slot.  This takes 3.4 ms
+ * for every byte that changes, so up to about 90 ms for a new lens. */
+void lensRecordStore(const LensRecord& r)
+{
+  LensSlot s;
+  s.version = LENS_RECORD_VERSION;
+  s.record = r;
+  s.checksum = ~slotSum(s);
+  eepromUpdate(slotAddress(r.id), &s, sizeof(s));
+}
@@ -0,0 +1,82 @@
+/* lensrecord.h
+ * What the body learns about a lens during power-up, and a cache of it in
+ * EEPROM so that a lens we've seen before doesn't have to be asked again.
+ *
+ * A lens is identified by its answer to C0 F6 00 00, and describes itself
+ * in answer to C1 F9 00 00.  The record keeps both as they came off the bus,
+ * with accessors for the fields we can make sense of.  Records live in a
+ * few EEPROM slots, picked by the identity the same way fakelens picks
+ * command slots, each with a version byte and a checksum so that erased or
+ * stale slots are never mistaken for a lens.
+ *
+ * A record can also carry the fastest bus timing the lens was found to keep
+ * up with, measured by fakebody built with -DCHARACTERIZE, and a table of
+ * where to focus at each zoom setting (see zoomtrack.h).
+ */
+
+#ifndef LENSRECORD_H_
+#define LENSRECORD_H_
+
+#include "typedef.h"
+
+// Payload bytes of the two responses, not counting the length or checksum
+#define LENS_ID_BYTES 4
+#define LENS_INFO_BYTES 20
+
+// Byte offsets in the C1 F9 response.  The rest is still a mystery, though
+// it probably holds the aperture and focus limits.
+#define LENS_INFO_SERIAL 6 // 9 ASCII characters
+#define LENS_INFO_SERIAL_BYTES 9
+#define LENS_INFO_FIRMWARE 18 // 2 bytes, maybe major and minor version
+
+// EEPROM layout
+#define LENS_RECORD_BASE 0 // Address of the first slot
+#define LENS_RECORD_SLOTS 4 // Must be a power of 2
+#define LENS_RECORD_VERSION 3 // Change whenever LensRecord does
+
+#define LENS_TIMING_NONE 0xff // For spiClock, if the lens hasn't been measured
+
+struct LensTiming
+{
+  uint8 spiClock; // One of the SPI_CLOCK_ values in hal.h
+  uint8 byteSetupUs; // Setup time before each byte (STEP_BYTE in fakebody)
+};
+
+/* The zoom table has a point every 16 steps of the raw zoom byte in the
+ * standby packet, so the raw zoom is a 4.4 fixed-point index into it, and
+ * the last point is just past the end of the range. */
+#define ZOOM_TABLE_SHIFT 4
+#define ZOOM_TABLE_POINTS ((256 >> ZOOM_TABLE_SHIFT) + 1)
+
+struct ZoomTable
+{
+  bool calibrated;
+  uint16 focus[ZOOM_TABLE_POINTS]; // In-focus position, as in the standby packet
+};
+
+struct LensRecord
+{
+  uint8 id[LENS_ID_BYTES];
+  uint8 info[LENS_INFO_BYTES];
+  LensTiming timing;
+  ZoomTable zoom;
+};
+
+// Copies the serial number into str, which needs room for 10 characters
+inline void lensSerial(const LensRecord& r, char* str)
+{
+  for(uint8 i = 0; i < LENS_INFO_SERIAL_BYTES; i++){
+    str[i] = r.info[LENS_INFO_SERIAL + i];
+  }
+  str[LENS_INFO_SERIAL_BYTES] = '\0';
+}
+
+inline uint16 lensFirmware(const LensRecord& r)
+{
+  return((r.info[LENS_INFO_FIRMWARE] << 8) | r.info[LENS_INFO_FIRMWARE + 1]);
+}
+
+bool lensRecordLoad(const uint8* id, LensRecord& r);
+void lensRecordStore(const LensRecord& r);
+
+#endif /* LENSRECORD_H_ */
@@ -0,0 +1,41 @@
+/* memory.cpp
+ * Stack painting and the SRAM report.  See memory.h.
+ */
+
+#ifndef MFT_HOST
+
+#include "memory.h"
+#include "hal.h"
+
+#define PAINT 0xc5
+
+extern uint8 __data_start; // Bottom of the static data
+extern uint8 __bss_end; // Top of it
+
+/* The startup code runs this in line, after the stack pointer is set up but
+ * before anything is on the stack, so the whole stack can be painted. */
+void memoryPaint() __attribute__((naked, used, section(".init3")));
+void memoryPaint()
+{
+  for(uint8* p = &__bss_end; p <= (uint8*)RAMEND; p++){
+    *p = PAINT;
+  }
+}
+
+void memoryReport()
+{
+  uint8* p = &__bss_end;
+  while(p <= (uint8*)RAMEND && *p == PAINT){
+    p++;
+  }
+
+  Serial.print(F("SRAM: "));
+  Serial.print((uint16)(&__bss_end - &__data_start));
+  Serial.print(F(" bytes static, "));
+  Serial.print((uint16)((uint8*)RAMEND + 1 - p));
+  Serial.print(F(" bytes of stack at most, "));
+  Serial.print((uint16)(p - &__bss_end));
+  Serial.println(F(" bytes never touched"));
+}
+
+#endif /* MFT_HOST */
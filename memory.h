@@ -0,0 +1,33 @@
+/* memory.h
+ * How much of the SRAM each program uses, for keeping an eye on the stack.
+ *
+ * The 2560 has 8 KB of SRAM, which holds the static data (.data and .bss)
+ * from the bottom up and the stack from the top down; nothing here uses the
+ * heap.  memsize.sh reports the static part at build time, but the stack
+ * only shows up at run time.  So at startup, before main(),
+ * everything between the static data and the stack is painted with a known
+ * value, and memoryReport() looks for the lowest byte the stack has
+ * written over since.  That is a high-water mark, so run the program
+ * through whatever you want it to cover before asking.
+ *
+ * On the host there is nothing to measure, and these do nothing.
+ */
+
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include "typedef.h"
+
+#ifndef MFT_HOST
+
+// Prints the static data size, the deepest the stack has been, and what was
+// never touched in between
+void memoryReport();
+
+#else
+
+inline void memoryReport() {}
+
+#endif /* MFT_HOST */
+
+#endif /* MEMORY_H_ */
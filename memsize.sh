@@ -0,0 +1,38 @@
+#!/bin/sh
+# memsize.sh
+# Build-time memory report: flash and static SRAM for each program, from the
+# ELF files the AVR build leaves behind, e.g.
+#   ./memsize.sh fakebody.elf fakelens.elf sniffer.elf
+#
+# The static SRAM (.data and .bss) has to leave room for the stack, which
+# only memoryReport() can measure (see memory.h).  Anything that leaves less
+# than STACK_RESERVE bytes for it is flagged, and the exit status is 1.
+
+SRAM_BYTES=8192
+FLASH_BYTES=262144
+STACK_RESERVE=${STACK_RESERVE:-1024}
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 program.elf ..." >&2
+  exit 2
+fi
+
+status=0
+for elf in "$@"; do
+  sections=$(avr-size -A "$elf") || exit 2
+  sizes=$(echo "$sections" | awk '
+    $1 == ".text" || $1 == ".data" { flash += $2 }
+    $1 == ".data" || $1 == ".bss" || $1 == ".noinit" { sram += $2 }
+    END { print flash + 0, sram + 0 }')
+  flash=${sizes% *}
+  sram=${sizes#* }
+  stack=$((SRAM_BYTES - sram))
+  printf '%s: %d bytes flash (%d%%), %d bytes static SRAM (%d%%), %d left for the stack' \
+    "$elf" "$flash" $((flash * 100 / FLASH_BYTES)) "$sram" $((sram * 100 / SRAM_BYTES)) "$stack"
+  if [ "$stack" -lt "$STACK_RESERVE" ]; then
+    printf ' (under %d)' "$STACK_RESERVE"
+    status=1
+  fi
+  echo
+done
+exit $status
@@ -0,0 +1,148 @@
+/* profile.cpp
+ * Histograms of bus transaction timing.  See profile.h.
+ */
+
+#ifdef PROFILE
+
+#include "profile.h"
+
+struct PhaseHistogram
+{
+  uint16 counts[PROFILE_BUCKETS];
+  uint32 samples;
+  uint32 total; // Of all the samples, in ticks
+  uint16 min;
+  uint16 max;
+};
+
+ProfileRecord profileCurrent;
+uint16 profileLast;
+bool profileActive = false;
+
+/* Finished transactions.  profileFinish() may run from an interrupt, so it
+ * only ever advances queueHead, and profileUpdate() only queueTail. */
+static ProfileRecord queue[PROFILE_QUEUE];
+static volatile uint8 queueHead = 0;
+static volatile uint8 queueTail = 0;
+static volatile uint16 missed = 0; // Transactions lost because the queue was full
+
+static PhaseHistogram histogram[PROFILE_PHASES];
+
+static const char phaseNames[PROFILE_PHASES][9] PROGMEM = {
+  "command", "checksum", "length", "payload", "handoff"
+};
+
+// Starts timing a new transaction, dropping anything left from the last one
+void profileStart()
+{
+  profileCurrent.phases = 0;
+  profileActive = true;
+  profileLast = ticks();
+}
+
+/* Ends the current transaction and queues it for profileUpdate().  This is
+ * only a copy, so it's fine to call at the end of a handshake. */
+void profileFinish()
+{
+  if(!profileActive){
+    return;
+  }
+  profileActive = false;
+  if(!profileCurrent.phases){
+    return;
+  }
+
+  uint8 head = queueHead;
+  if(((head + 1) & (PROFILE_QUEUE - 1)) == queueTail){
+    missed++;
+    return;
+  }
+  queue[head] = profileCurrent;
+  queueHead = (head + 1) & (PROFILE_QUEUE - 1);
+}
+
+static uint8 bucketOf(uint16 t)
+{
+  uint8 b = 0;
+  while(t >>= 1){
+    b++;
+  }
+  return(b);
+}
+
+static void addSample(PhaseHistogram& h, uint16 t)
+{
+  uint8 b = bucketOf(t);
+  if(h.counts[b] != 0xffff){
+    h.counts[b]++;
+  }
+  if(h.samples == 0 || t < h.min){
+    h.min = t;
+  }
+  if(t > h.max){
+    h.max = t;
+  }
+  h.samples++;
+  h.total += t;
+}
+
+/* Sorts the queued transactions into the histograms.  Call this from the main
+ * loop, away from anything timing-critical. */
+void profileUpdate()
+{
+  while(queueTail != queueHead){
+    const ProfileRecord& r = queue[queueTail];
+    for(uint8 p = 0; p < PROFILE_PHASES; p++){
+      if(r.phases & (1 << p)){
+        addSample(histogram[p], r.ticks[p]);
+      }
+    }
+    queueTail = (queueTail + 1) & (PROFILE_QUEUE - 1);
+  }
+}
+
+/* Prints the histograms.  This takes a good few milliseconds at 115200 baud,
+ * during which nothing else gets done, so only do it when asked. */
+void profileDump()
+{
+  profileUpdate();
+  Serial.println(F("Transaction profile (us):"));
+  for(uint8 p = 0; p < PROFILE_PHASES; p++){
+    const PhaseHistogram& h = histogram[p];
+    if(h.samples == 0){
+      continue;
+    }
+    Serial.print((const __FlashStringHelper*)phaseNames[p]);
+    Serial.print(F(": "));
+    Serial.print(h.samples);
+    Serial.print(F(" samples, min "));
+    Serial.print(h.min / TICKS_PER_US);
+    Serial.print(F(", mean "));
+    Serial.print(h.total / h.samples / TICKS_PER_US);
+    Serial.print(F(", max "));
+    Serial.println(h.max / TICKS_PER_US);
+    for(uint8 b = 0; b < PROFILE_BUCKETS; b++){
+      if(h.counts[b]){
+        Serial.print(F("  under "));
+        Serial.print((2UL << b) / TICKS_PER_US);
+        Serial.print(F(": "));
+        Serial.println(h.counts[b]);
+      }
+    }
+  }
+  if(missed){
+    Serial.print(F("Transactions missed: "));
+    Serial.println(missed);
+  }
+}
+
+void profileClear()
+{
+  profileUpdate();
+  for(uint8 p = 0; p < PROFILE_PHASES; p++){
+    histogram[p] = PhaseHistogram();
+  }
+  missed = 0;
+}
+
+#endif /* PROFILE */
@@ -0,0 +1,80 @@
+/* profile.h
+ * Timing profile of bus transactions, for both the lens and body code.
+ *
+ * Build with -DPROFILE to turn it on; otherwise everything here compiles to
+ * nothing.  A transaction is split into phases, and the end of each phase is
+ * stamped from the tick timer (see hal.h) as it goes by.  Stamping is only a
+ * timer read and a store, so it is safe in the middle of a handshake or an
+ * interrupt handler.  Finished transactions wait in a small queue until the
+ * main loop calls profileUpdate(), which sorts them into histograms, and
+ * profileDump() prints those over Serial.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "typedef.h"
+#include "hal.h"
+
+enum ProfilePhase {
+  PHASE_COMMAND, // Start of the transaction to the last command byte
+  PHASE_CHECKSUM, // Turnaround of the data line and the command checksum
+  PHASE_LENGTH, // Length bytes of the packet that follows
+  PHASE_PAYLOAD, // Rest of the packet, up to the end of the transaction
+  PHASE_HANDOFF, // Between an extended command and its packet
+  PROFILE_PHASES
+};
+
+/* Histogram buckets go up in powers of two: bucket b holds times from 2^b up
+ * to 2^(b+1) ticks, except that bucket 0 also holds zero.  16 buckets cover
+ * everything the 16-bit timer can measure. */
+#define PROFILE_BUCKETS 16
+
+// Finished transactions waiting for profileUpdate().  Must be a power of 2.
+#define PROFILE_QUEUE 4
+
+#ifdef PROFILE
+
+struct ProfileRecord
+{
+  uint16 ticks[PROFILE_PHASES]; // Length of each phase
+  uint8 phases; // Bit mask of the phases that were stamped
+};
+
+// Transaction in progress
+extern ProfileRecord profileCurrent;
+extern uint16 profileLast; // Time of the last stamp
+extern bool profileActive;
+
+void profileStart();
+
+// Stamps the end of a phase of the current transaction
+inline void profileMark(ProfilePhase phase)
+{
+  uint16 now = ticks();
+  profileCurrent.ticks[phase] = now - profileLast;
+  profileCurrent.phases |= (1 << phase);
+  profileLast = now;
+}
+
+// Leaves the current transaction out of the profile
+inline void profileDiscard() { profileActive = false; }
+
+void profileFinish();
+void profileUpdate();
+void profileDump();
+void profileClear();
+
+#else
+
+inline void profileStart() {}
+inline void profileMark(ProfilePhase) {}
+inline void profileDiscard() {}
+inline void profileFinish() {}
+inline void profileUpdate() {}
+inline void profileDump() {}
+inline void profileClear() {}
+
+#endif /* PROFILE */
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,24 @@
+/* progmem.h
+ * Constant data kept in program memory.  On the AVR, flash is a separate
+ * address space from SRAM, and anything marked PROGMEM stays there and has
+ * to be read with the pgm_read_ functions.  Everywhere else (the simulator
+ * and the host tools) it's ordinary memory.
+ */
+
+#ifndef PROGMEM_H_
+#define PROGMEM_H_
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#include <string.h>
+#include "typedef.h"
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8*)(address))
+#define pgm_read_word(address) (*(const uint16*)(address))
+#define pgm_read_dword(address) (*(const uint32*)(address))
+#define pgm_read_ptr(address) (*(void* const*)(address))
+#define memcpy_P memcpy
+#endif
+
+#endif /* PROGMEM_H_ */
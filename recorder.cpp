@@ -0,0 +1,87 @@
+/* recorder.cpp
+ * Ring buffer of bus transactions.  See recorder.h.
+ */
+
+#ifdef RECORD
+
+#include "recorder.h"
+#include "telemetry.h"
+#include "hal.h"
+
+/* Records are written and read whole from the main loop, so the indices
+ * need no protection.  They run freely and are masked on use. */
+static uint8 ring[RECORDER_BYTES];
+static uint16 head = 0; // Next byte to fill
+static uint16 tail = 0; // Length byte of the oldest record
+static bool flushing = false;
+
+static inline uint8& at(uint16 i)
+{
+  return(ring[i & (RECORDER_BYTES - 1)]);
+}
+
+static inline void put(uint8 value)
+{
+  at(head++) = value;
+}
+
+/* Adds a transaction to the ring, dropping the oldest to make room.  While
+ * a flush is going on nothing is added, so that what reaches the host is
+ * exactly what was there when it was asked for. */
+void recordTransaction(const uint8* command, uint8 flags, uint32 startUs,
+                       uint16 duration, const uint8* data, uint8 nBytes)
+{
+  if(flushing){
+    return;
+  }
+  if(nBytes > RECORD_MAX_DATA){
+    nBytes = RECORD_MAX_DATA;
+  }
+  uint8 length = RECORD_HEADER + nBytes;
+  while((uint16)(RECORDER_BYTES - (head - tail)) < length + 1){
+    tail += at(tail) + 1;
+  }
+
+  put(length);
+  put(flags);
+  for(uint8 i = 0; i < 4; i++){
+    put(startUs >> (8 * i));
+  }
+  put(duration);
+  put(duration >> 8);
+  for(uint8 i = 0; i < 4; i++){
+    put(command[i]);
+  }
+  for(uint8 i = 0; i < nBytes; i++){
+    put(data[i]);
+  }
+}
+
+void recorderFlushStart()
+{
+  flushing = true;
+}
+
+/* Sends as many records as the telemetry stream has room for right now.
+ * Call once a frame; it does nothing unless a flush has been started. */
+void recorderFlush()
+{
+  uint8 record[RECORD_HEADER + RECORD_MAX_DATA];
+  while(flushing){
+    if(tail == head){
+      flushing = false; // Done, and empty
+      break;
+    }
+    uint8 length = at(tail);
+    if(telemetryRoom() < length){
+      break;
+    }
+    for(uint8 i = 0; i < length; i++){
+      record[i] = at(tail + 1 + i);
+    }
+    telemetrySend(TELEMETRY_TRACE, record, length);
+    tail += length + 1;
+  }
+}
+
+#endif /* RECORD */
@@ -0,0 +1,56 @@
+/* recorder.h
+ * Recording of bus transactions in fakebody, for replaying through fakelens
+ * (built with -DREPLAY) or comparing on the host.
+ *
+ * Build with -DRECORD to turn it on; otherwise everything here compiles to
+ * nothing.  Every transaction that carries data (queries, standby packets
+ * and extended packets) goes into a ring buffer in SRAM as a record, and
+ * once it's full the oldest records make way.  Sending an 'r' over the
+ * serial port freezes the buffer and flushes it to the host in bulk over
+ * TX1, one TELEMETRY_TRACE frame per record, as fast as the telemetry
+ * stream has room; recording starts again, from empty, once it's done.
+ *
+ * A record is, multi-byte fields LSB first:
+ *   flags (1)      RECORD_OK, RECORD_TIMEOUT, RECORD_SENT, RECORD_UNKNOWN
+ *   time (4)       micros() at the start of the transaction
+ *   duration (2)   Length of the transaction, in ticks (see hal.h)
+ *   command (4)    In the order it was sent
+ *   data           The response, or the packet we sent if RECORD_SENT
+ * In the ring, and in a replay trace, each record is preceded by a byte
+ * with its length.
+ */
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include "typedef.h"
+
+// Flags
+#define RECORD_OK 0x01 // Checksums matched
+#define RECORD_TIMEOUT 0x02 // A wait on the lens ran out (see fakebody)
+#define RECORD_SENT 0x04 // The data went to the lens rather than coming back
+#define RECORD_UNKNOWN 0x08 // Not in commands.h, so what followed wasn't kept
+
+#define RECORD_HEADER 11 // Bytes of a record before the data
+#define RECORD_MAX_DATA 32 // Anything longer is cut short
+
+// Ring buffer size.  Must be a power of 2.
+#define RECORDER_BYTES 1024
+
+#ifdef RECORD
+
+void recordTransaction(const uint8* command, uint8 flags, uint32 startUs,
+                       uint16 duration, const uint8* data, uint8 nBytes);
+void recorderFlushStart();
+void recorderFlush();
+
+#else
+
+inline void recordTransaction(const uint8*, uint8, uint32, uint16, const uint8*,
+                              uint8) {}
+inline void recorderFlushStart() {}
+inline void recorderFlush() {}
+
+#endif /* RECORD */
+
+#endif /* RECORDER_H_ */
@@ -0,0 +1,110 @@
+/* replaytrace.h
+ * Trace for fakelens -DREPLAY: the records from a fakebody -DRECORD flush,
+ * each preceded by its length (see recorder.h).  This one came from the host
+ * simulator, and has a focus command and the standby packets that follow
+ * it while the focus moves and settles.
+ */
+
+#ifndef REPLAYTRACE_H_
+#define REPLAYTRACE_H_
+
+#include "typedef.h"
+
+const uint8 replayTrace[] PROGMEM = {
+  0x14, 0x05, 0x09, 0x54, 0x11, 0x00, 0x9b, 0x01, 0x60, 0x80, 0x03, 0xfe,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x4e, 0x02, 0x00, 0x00,
+  0x29, 0x01, 0x1f, 0x93, 0x11, 0x00, 0xfb, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x13, 0x1b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4d, 0x00, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x3a, 0xd4, 0x11, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x23, 0x1d, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x8f, 0x00, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x54, 0x15, 0x12, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x34, 0x1f, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0xd0, 0x00, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x6f, 0x56, 0x12, 0x00, 0xf8, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x45, 0x22, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x16, 0x01, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x8a, 0x97, 0x12, 0x00, 0xf8, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x55, 0x25, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x57, 0x01, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xa4, 0xd8, 0x12, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x66, 0x29, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x99, 0x01, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xbf, 0x19, 0x13, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x76, 0x2e, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0xda, 0x01, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xda, 0x5a, 0x13, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x88, 0x35, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x20, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xf4, 0x9b, 0x13, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x0f, 0xdd, 0x13, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x2a, 0x1e, 0x14, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x44, 0x5f, 0x14, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x5f, 0xa0, 0x14, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x7a, 0xe1, 0x14, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x94, 0x22, 0x15, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xaf, 0x63, 0x15, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xca, 0xa4, 0x15, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xe4, 0xe5, 0x15, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0xff, 0x26, 0x16, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x1a, 0x68, 0x16, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x34, 0xa9, 0x16, 0x00, 0xf6, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x4f, 0xea, 0x16, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+  0x29, 0x01, 0x6a, 0x2b, 0x17, 0x00, 0xfc, 0x03, 0xc1, 0x80, 0x01, 0x06,
+    0xc2, 0xe1, 0x00, 0x00, 0x00, 0x93, 0x3b, 0x00, 0xb2, 0x03, 0x00, 0x0c,
+    0x4e, 0x02, 0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01, 0x47, 0x02,
+    0xa4, 0x5c, 0x03, 0x4e, 0x02, 0x00,
+};
+
+#endif /* REPLAYTRACE_H_ */
@@ -0,0 +1,1125 @@
+/* sim.cpp
+ * Shared-memory MFT bus simulator and Arduino core stand-in for host builds.
+ * See sim.h for an overview and the environment variables it reads.
+ *
+ * Every process owns one slot on the bus with its own pin directions, port
+ * latches and SPI peripheral.  The level of each line is resolved from all
+ * of the slots driving it, and edges on CLK clock the SPI shift registers of
+ * every slot, just like the real hardware.  Only the process holding the turn
+ * touches the shared state, so no further locking is needed.
+ */
+
+#ifdef MFT_HOST
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hal.h"
+
+#define SIM_MAGIC 0x4d465442 // "MFTB"
+#define SIM_SLOTS 4
+#define SIM_PINS 70 // Arduino Mega 2560 pin count
+
+#define F_CPU_HZ 16000000UL
+#define CYCLES_PER_US (F_CPU_HZ / 1000000UL)
+
+// Approximate cost of each operation in CPU cycles.  The Arduino calls are
+// slow because they look up the port and timer for the pin every time.
+const uint32 COST_DIGITAL_WRITE = 56;
+const uint32 COST_DIGITAL_READ = 50;
+const uint32 COST_PIN_MODE = 50;
+const uint32 COST_PORT_WRITE = 2;
+const uint32 COST_PIN_READ = 3; // Including the loop branch when polling
+const uint32 COST_SPI_REG = 2;
+const uint32 COST_SERIAL_CHAR = 20;
+const uint32 COST_MICROS = 40;
+const uint32 COST_TIMER_READ = 4;
+const uint32 COST_ISR_ENTRY = 30; // Vectoring plus the register pushes
+const uint32 COST_ISR_EXIT = 25;
+const uint32 COST_EEPROM_READ = 4; // Per byte
+const uint32 COST_EEPROM_WRITE = 54400; // Per byte changed: 3.4 ms to erase and program
+
+#define SIM_EEPROM_BYTES 4096
+
+struct SimSpi
+{
+  uint8 enabled;
+  uint8 shift; // Shift register
+  uint8 rx; // Last complete byte received
+  uint8 bits; // Bits shifted since the last complete byte
+  uint8 spif; // Transfer complete flag
+  uint8 spifSeen; // SPSR was read with SPIF set, so the next SPDR access clears it
+  uint8 out; // Bit currently presented on MISO, or MOSI for a master
+
+  // Master mode.  The clock is generated in the background as time passes.
+  uint8 master;
+  uint8 sck; // Level driven onto CLK
+  uint8 edgesLeft; // Clock edges left in the current transfer
+  uint32 halfPeriod; // CPU cycles between clock edges
+  uint64 nextEdge;
+};
+
+/* USART1.  The transmitter is modelled without its second buffer: each byte
+ * keeps it busy for a whole character time.  Received bytes come from a file
+ * or pipe, no faster than the baud rate, whenever there is one to read.  As
+ * on the AVR, they wait in a two-byte buffer until UDR1 is read, and one
+ * that finishes arriving while the buffer is full is lost, with DOR1 set. */
+#define SIM_RX_BUFFER 2
+struct SimUart
+{
+  uint32 charCycles; // CPU cycles per character
+  uint8 busy;
+  uint64 txDone; // When the byte being sent is finished
+  uint8 rxEnabled;
+  uint8 rx[SIM_RX_BUFFER]; // Bytes received and not yet read, oldest first
+  uint8 rxCount;
+  uint8 overrun; // DOR1, until the next read
+  uint64 overruns; // Bytes lost, for the stats
+  uint64 rxNext; // When to look for the next byte
+};
+
+// How often to look for input when there isn't any, in character times
+#define SIM_RX_IDLE 50
+
+// Output compares on timer 1, which counts F_CPU / 8 from power-up
+#define SIM_ALARMS 2
+struct SimTimer
+{
+  uint8 enabled[SIM_ALARMS];
+  uint64 match[SIM_ALARMS]; // When the count next equals the compare register
+};
+
+struct SimSlot
+{
+  uint8 live;
+  int32 pid;
+  uint64 now; // Virtual time in CPU cycles
+  uint8 dir[SIM_PINS]; // 1 if the pin is an output
+  uint8 port[SIM_PINS]; // Output latch, or pull-up enable for inputs
+  SimSpi spi;
+  SimUart uart;
+  SimTimer timer;
+
+  // Interrupts.  Other processes raise them, so they live on the bus too.
+  uint8 sreg; // Global interrupt enable
+  uint8 inIsr;
+  uint32 irqEnabled; // One bit per SimVector
+  uint32 irqPending;
+};
+
+// Latency between an edge on one ACK line and the answering edge on the other
+struct SimLatency
+{
+  uint8 pending;
+  uint64 since;
+  uint64 count;
+  uint64 total;
+  uint64 max;
+};
+
+struct SimBus
+{
+  std::atomic<uint32> lock;
+  uint32 magic;
+  std::atomic<int32> turn; // Slot which is allowed to run
+  std::atomic<int32> attached; // Slots handed out so far
+  uint8 net[SIM_PINS]; // Resolved line levels, indexed by pin
+  SimSlot slot[SIM_SLOTS];
+
+  uint64 endTime;
+  uint64 clkRises;
+  uint64 shutterPulses;
+  SimLatency lensLatency; // BODY_ACK edge -> LENS_ACK edge
+  SimLatency bodyLatency; // LENS_ACK edge -> BODY_ACK edge
+};
+
+static SimBus* bus = NULL;
+static SimSlot* self = NULL;
+static int32 me = -1;
+static uint64 limitCycles = 0;
+static char busName[64] = "/mftbus";
+static bool trace = false;
+static FILE* uartOut = NULL; // Where the second serial port goes, if anywhere
+static int uartIn = -1; // And where its input comes from
+static const char* eepromFile = NULL;
+static int captureFd = -1; // Logic analyzer style capture of the bus lines
+static uint8 eeprom[SIM_EEPROM_BYTES]; // Erased EEPROM reads as 0xff
+
+SimSerial Serial;
+
+static SimIsr isrTable[SIM_VECTORS]; // Filled in by the ISR() macro
+
+static void simDetach();
+
+/* Returns the pin that identifies the line a pin is wired to.  MISO and MOSI
+ * are tied together externally into the single data line. */
+static uint8 netOf(uint8 pin)
+{
+  return(pin == DATA_MOSI ? DATA_MISO : pin);
+}
+
+// Returns the level a slot drives onto a pin, or -1 if it isn't driving it
+static int8 pinDrive(const SimSlot& s, uint8 pin)
+{
+  // A master's MISO is forced to be an input
+  if(!s.dir[pin] || (s.spi.enabled && s.spi.master && pin == DATA_MISO)){
+    return(-1);
+  }
+  if(s.spi.enabled && pin == (s.spi.master ? DATA_MOSI : DATA_MISO)){
+    return(s.spi.out);
+  }
+  if(s.spi.enabled && s.spi.master && pin == CLK){
+    return(s.spi.sck);
+  }
+  return(s.port[pin]);
+}
+
+// Works out the level of a line from everything connected to it
+static uint8 resolve(uint8 net)
+{
+  bool driven = false;
+  bool pulled = false;
+  uint8 level = 1;
+
+  for(int32 i = 0; i < SIM_SLOTS; i++){
+    const SimSlot& s = bus->slot[i];
+    if(!s.live){
+      continue;
+    }
+    for(uint8 pin = net; pin <= (net == DATA_MISO ? DATA_MOSI : net); pin++){
+      int8 d = pinDrive(s, pin);
+      if(d >= 0){
+        driven = true;
+        level &= d; // Contention pulls the line low
+      }
+      else if(s.port[pin]){
+        pulled = true;
+      }
+    }
+  }
+
+  if(driven){
+    return(level);
+  }
+  // Nobody is driving, so the line keeps its last level unless pulled up
+  return(pulled ? 1 : bus->net[net]);
+}
+
+static void latencyEdge(SimLatency& answered, SimLatency& started)
+{
+  uint64 now = self->now;
+  if(answered.pending){
+    uint64 dt = now - answered.since;
+    answered.count++;
+    answered.total += dt;
+    if(dt > answered.max){
+      answered.max = dt;
+    }
+    answered.pending = 0;
+  }
+  if(!started.pending){
+    started.pending = 1;
+    started.since = now;
+  }
+}
+
+static void updateNet(uint8 net);
+
+SimIsrHook::SimIsrHook(SimVector vector, SimIsr isr)
+{
+  isrTable[vector] = isr;
+}
+
+/* Flags an interrupt on a slot.  If that process is partway through a delay
+ * or a slow operation, it is wound back to now so the handler runs on time. */
+static void simRaise(SimSlot& s, SimVector vector)
+{
+  uint32 bit = 1UL << vector;
+  if(!(s.irqEnabled & bit)){
+    return;
+  }
+  s.irqPending |= bit;
+  if(s.sreg && !s.inIsr && s.now > self->now){
+    s.now = self->now;
+  }
+}
+
+/* Adds a row to the capture with the levels of all four lines.  Rows are
+ * written whole with O_APPEND, so both processes can share the file. */
+static void captureRow()
+{
+  char row[64];
+  int n = snprintf(row, sizeof(row), "%.9f,%d,%d,%d,%d\n",
+                   (double)self->now / F_CPU_HZ, bus->net[CLK], bus->net[DATA_MISO],
+                   bus->net[BODY_ACK], bus->net[LENS_ACK]);
+  if(write(captureFd, row, n) != n){
+    perror("mftsim: MFT_SIM_CAPTURE");
+    captureFd = -1;
+  }
+}
+
+// Called whenever the resolved level of a line changes
+static void edge(uint8 net, uint8 level)
+{
+  if(trace){
+    fprintf(stderr, "%12.3f us [%d] pin %d -> %d\n",
+            (double)self->now / CYCLES_PER_US, me, net, level);
+  }
+  if(captureFd >= 0 && (net == CLK || net == DATA_MISO || net == BODY_ACK || net == LENS_ACK)){
+    captureRow();
+  }
+  if(net == BODY_ACK){
+    latencyEdge(bus->bodyLatency, bus->lensLatency);
+    for(int32 i = 0; i < SIM_SLOTS; i++){
+      if(bus->slot[i].live){
+        simRaise(bus->slot[i], BODY_ACK_vect);
+      }
+    }
+  }
+  else if(net == LENS_ACK){
+    latencyEdge(bus->lensLatency, bus->bodyLatency);
+  }
+  else if(net == SHUTTER && level){
+    bus->shutterPulses++;
+  }
+  else if(net == CLK){
+    if(level){
+      bus->clkRises++;
+    }
+
+    // CPOL = 1, CPHA = 1: shift out on the falling edge, sample on the rising.
+    // Masters and slaves shift the same way, since the data line is shared.
+    for(int32 i = 0; i < SIM_SLOTS; i++){
+      SimSpi& spi = bus->slot[i].spi;
+      if(!bus->slot[i].live || !spi.enabled){
+        continue;
+      }
+      if(!level){
+        spi.out = spi.shift & 0x01;
+      }
+      else{
+        spi.shift = (spi.shift >> 1) | (bus->net[DATA_MISO] << 7); // LSB-first
+        if(++spi.bits == 8){
+          spi.bits = 0;
+          spi.rx = spi.shift;
+          spi.spif = 1;
+          simRaise(bus->slot[i], SPI_STC_vect);
+          if(trace){
+            fprintf(stderr, "%12.3f us [%d] spi %02x\n",
+                    (double)self->now / CYCLES_PER_US, i, spi.rx);
+          }
+        }
+      }
+    }
+    updateNet(DATA_MISO);
+  }
+}
+
+static void updateNet(uint8 net)
+{
+  uint8 level = resolve(net);
+  if(level != bus->net[net]){
+    bus->net[net] = level;
+    edge(net, level);
+  }
+}
+
+static bool alive(int32 pid)
+{
+  return(kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/* Hands the bus to whichever process is furthest behind in virtual time, and
+ * returns once this process is the furthest behind again. */
+static void simYield()
+{
+  for(;;){
+    int32 next = me;
+    for(int32 i = 0; i < SIM_SLOTS; i++){
+      if(bus->slot[i].live && bus->slot[i].now < bus->slot[next].now){
+        next = i;
+      }
+    }
+    if(next == me){
+      return;
+    }
+
+    bus->turn.store(next);
+    uint32 spins = 0;
+    while(bus->turn.load() != me){
+      sched_yield();
+      // Don't wait forever on a process that died without detaching
+      int32 holder = bus->turn.load();
+      if(++spins % 4096 == 0 && holder != me && !alive(bus->slot[holder].pid)){
+        bus->slot[holder].live = 0;
+        bus->turn.store(me);
+      }
+    }
+  }
+}
+
+static void simAdvance(uint64 cycles);
+static void simDispatch();
+static void simRaiseNow(SimVector vector);
+
+// Takes in the next byte for USART1, if there is one yet
+static void simUartReceive()
+{
+  SimUart& uart = self->uart;
+  struct pollfd p = {uartIn, POLLIN, 0};
+  uint8 c;
+  if(poll(&p, 1, 0) != 1){
+    uart.rxNext += SIM_RX_IDLE * uart.charCycles;
+    return;
+  }
+  if(read(uartIn, &c, 1) != 1){
+    close(uartIn); // End of the input
+    uartIn = -1;
+    return;
+  }
+  uart.rxNext += uart.charCycles;
+  if(uart.rxCount == SIM_RX_BUFFER){
+    uart.overrun = 1;
+    uart.overruns++;
+    return;
+  }
+  uart.rx[uart.rxCount++] = c;
+  simRaiseNow(USART1_RX_vect);
+}
+
+/* Flags one of our own interrupts, from something that happens in the
+ * background, and runs it right away rather than at the end of whatever
+ * delay or operation we're in the middle of. */
+static void simRaiseNow(SimVector vector)
+{
+  simRaise(*self, vector);
+  if(self->sreg && !self->inIsr && self->irqPending){
+    simDispatch();
+  }
+}
+
+// Runs the highest priority pending interrupt handler
+static void simDispatch()
+{
+  uint8 vector = 0;
+  while(!(self->irqPending & (1UL << vector))){
+    vector++;
+  }
+  self->irqPending &= ~(1UL << vector);
+  if(vector == SPI_STC_vect){
+    self->spi.spif = 0; // Cleared by hardware when the vector runs
+  }
+
+  self->inIsr = 1;
+  self->sreg = 0;
+  simAdvance(COST_ISR_ENTRY);
+  if(isrTable[vector]){
+    isrTable[vector]();
+  }
+  simAdvance(COST_ISR_EXIT);
+  self->sreg = 1;
+  self->inIsr = 0;
+}
+
+/* Spends some number of CPU cycles, letting the other processes catch up.
+ * Any interrupts which come in meanwhile are run at the time they arrive, and
+ * a transfer from our SPI master clocks along at its own pace. */
+static void simAdvance(uint64 cycles)
+{
+  if(!bus || me < 0){
+    return;
+  }
+  SimSpi& spi = self->spi;
+  SimUart& uart = self->uart;
+  SimTimer& timer = self->timer;
+  uint64 target = self->now + cycles;
+  for(;;){
+    // Find whichever happens first of the background events
+    uint64 step = target;
+    bool clocking = false;
+    bool sent = false;
+    bool received = false;
+    int8 alarm = -1;
+    if(spi.edgesLeft && spi.nextEdge <= step){
+      step = spi.nextEdge;
+      clocking = true;
+    }
+    if(uart.busy && uart.txDone <= step){
+      step = uart.txDone;
+      clocking = false;
+      sent = true;
+    }
+    for(uint8 i = 0; i < SIM_ALARMS; i++){
+      if(timer.enabled[i] && timer.match[i] <= step){
+        step = timer.match[i];
+        clocking = sent = false;
+        alarm = i;
+      }
+    }
+    if(uart.rxEnabled && uartIn >= 0 && uart.rxNext <= step){
+      step = uart.rxNext;
+      clocking = sent = false;
+      alarm = -1;
+      received = true;
+    }
+
+    if(self->now < step){
+      self->now = step;
+    }
+    if(limitCycles && self->now >= limitCycles){
+      exit(0);
+    }
+    simYield();
+    if(self->sreg && !self->inIsr && self->irqPending){
+      simDispatch();
+    }
+    else if(sent){
+      uart.busy = 0;
+      simRaiseNow(USART1_UDRE_vect);
+    }
+    else if(alarm >= 0){
+      timer.match[alarm] += 8 * 65536UL; // Next time round, unless it's moved
+      simRaiseNow(alarm == 0 ? TIMER1_COMPA_vect : TIMER1_COMPB_vect);
+    }
+    else if(received){
+      simUartReceive();
+    }
+    else if(clocking){
+      spi.edgesLeft--;
+      spi.nextEdge += spi.halfPeriod;
+      spi.sck = !spi.sck;
+      updateNet(CLK);
+    }
+    else{
+      return;
+    }
+  }
+}
+
+static void lockBus()
+{
+  uint32 unlocked = 0;
+  while(!bus->lock.compare_exchange_weak(unlocked, 1)){
+    unlocked = 0;
+    sched_yield();
+  }
+}
+
+static void unlockBus()
+{
+  bus->lock.store(0);
+}
+
+static void printLatency(const char* name, const SimLatency& l)
+{
+  if(l.count == 0){
+    return;
+  }
+  fprintf(stderr, "mftsim: %s: %llu handshakes, mean %.2f us, max %.2f us\n",
+          name, (unsigned long long)l.count,
+          (double)l.total / l.count / CYCLES_PER_US,
+          (double)l.max / CYCLES_PER_US);
+}
+
+static void printStats()
+{
+  double ms = (double)bus->endTime / (CYCLES_PER_US * 1000);
+  fprintf(stderr, "mftsim: %.3f ms virtual time\n", ms);
+  fprintf(stderr, "mftsim: %llu bytes clocked, %llu shutter pulses (%.1f Hz)\n",
+          (unsigned long long)(bus->clkRises / 8),
+          (unsigned long long)bus->shutterPulses,
+          ms > 0 ? bus->shutterPulses * 1000.0 / ms : 0.0);
+  printLatency("lens response to BODY_ACK", bus->lensLatency);
+  printLatency("body response to LENS_ACK", bus->bodyLatency);
+}
+
+// Leaves the bus, passing the turn on.  The last one out reports and cleans up.
+static void simDetach()
+{
+  if(!bus || me < 0){
+    return;
+  }
+  fflush(stdout);
+  if(uartOut){
+    fflush(uartOut);
+  }
+  if(self->uart.overruns){
+    fprintf(stderr, "mftsim: %llu bytes lost to USART1 overruns\n",
+            (unsigned long long)self->uart.overruns);
+  }
+  lockBus();
+  self->live = 0;
+  if(self->now > bus->endTime){
+    bus->endTime = self->now;
+  }
+  // Our lines no longer drive anything
+  for(uint8 pin = 0; pin < SIM_PINS; pin++){
+    if(self->dir[pin]){
+      updateNet(netOf(pin));
+    }
+  }
+
+  int32 next = -1;
+  for(int32 i = 0; i < SIM_SLOTS; i++){
+    if(bus->slot[i].live && (next < 0 || bus->slot[i].now < bus->slot[next].now)){
+      next = i;
+    }
+  }
+  if(next < 0){
+    printStats();
+    bus->magic = 0;
+    shm_unlink(busName);
+  }
+  else{
+    bus->turn.store(next);
+  }
+  unlockBus();
+  me = -1;
+}
+
+static void simSignal(int sig)
+{
+  simDetach();
+  _exit(128 + sig);
+}
+
+/* Attaches to the shared bus and waits for the other processes to show up.
+ * This stands in for the Arduino core's init(). */
+void init()
+{
+  const char* name = getenv("MFT_BUS");
+  if(name){
+    snprintf(busName, sizeof(busName), "%s%s", name[0] == '/' ? "" : "/", name);
+  }
+  const char* peersEnv = getenv("MFT_SIM_PEERS");
+  int32 peers = peersEnv ? atoi(peersEnv) : 2;
+  const char* limitEnv = getenv("MFT_SIM_MS");
+  limitCycles = limitEnv ? (uint64)atol(limitEnv) * CYCLES_PER_US * 1000 : 0;
+  trace = getenv("MFT_SIM_TRACE") != NULL;
+  const char* uartEnv = getenv("MFT_SIM_UART1");
+  if(uartEnv){
+    uartOut = fopen(uartEnv, "wb");
+    if(!uartOut){
+      perror("mftsim: MFT_SIM_UART1");
+      exit(1);
+    }
+  }
+  const char* uartInEnv = getenv("MFT_SIM_UART1_IN");
+  if(uartInEnv){
+    uartIn = open(uartInEnv, O_RDONLY);
+    if(uartIn < 0){
+      perror("mftsim: MFT_SIM_UART1_IN");
+      exit(1);
+    }
+  }
+
+  memset(eeprom, 0xff, sizeof(eeprom));
+  eepromFile = getenv("MFT_SIM_EEPROM");
+  if(eepromFile){
+    FILE* f = fopen(eepromFile, "rb");
+    if(f){
+      size_t n = fread(eeprom, 1, sizeof(eeprom), f);
+      (void)n; // A short file just leaves the rest erased
+      fclose(f);
+    }
+  }
+
+  int fd = shm_open(busName, O_RDWR | O_CREAT, 0600);
+  if(fd < 0 || ftruncate(fd, sizeof(SimBus)) != 0){
+    perror("mftsim: shm_open");
+    exit(1);
+  }
+  bus = (SimBus*)mmap(NULL, sizeof(SimBus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(bus == MAP_FAILED){
+    perror("mftsim: mmap");
+    exit(1);
+  }
+
+  lockBus();
+  // Start fresh if the bus is new or everyone on it has gone away
+  bool stale = (bus->magic != SIM_MAGIC);
+  if(!stale){
+    stale = true;
+    for(int32 i = 0; i < SIM_SLOTS; i++){
+      if(bus->slot[i].live && alive(bus->slot[i].pid)){
+        stale = false;
+      }
+    }
+  }
+  if(stale){
+    memset((char*)bus + sizeof(bus->lock), 0, sizeof(SimBus) - sizeof(bus->lock));
+    bus->magic = SIM_MAGIC;
+  }
+  // Whoever starts the bus starts the capture afresh
+  const char* captureEnv = getenv("MFT_SIM_CAPTURE");
+  if(captureEnv){
+    captureFd = open(captureEnv, O_WRONLY | O_CREAT | O_APPEND | (stale ? O_TRUNC : 0), 0644);
+    if(captureFd < 0){
+      perror("mftsim: MFT_SIM_CAPTURE");
+    }
+    else if(stale){
+      const char* header = "Time [s],CLK,DATA,BODY_ACK,LENS_ACK\n";
+      if(write(captureFd, header, strlen(header)) < 0){
+        perror("mftsim: MFT_SIM_CAPTURE");
+      }
+    }
+  }
+  me = bus->attached.fetch_add(1);
+  if(me >= SIM_SLOTS){
+    unlockBus();
+    fprintf(stderr, "mftsim: too many processes on %s\n", busName);
+    exit(1);
+  }
+  self = &bus->slot[me];
+  self->pid = getpid();
+  self->live = 1;
+  self->sreg = 1; // The Arduino core enables interrupts in init()
+  unlockBus();
+
+  atexit(simDetach);
+  signal(SIGINT, simSignal);
+  signal(SIGTERM, simSignal);
+
+  while(bus->attached.load() < peers){
+    usleep(1000);
+  }
+  while(bus->turn.load() != me){
+    sched_yield();
+  }
+}
+
+/* Most operations first spend their cycles and then take effect, since the
+ * Arduino calls do most of their work before touching the port. */
+void pinMode(uint8 pin, uint8 mode)
+{
+  simAdvance(COST_PIN_MODE);
+  self->dir[pin] = (mode == OUTPUT);
+  if(mode != OUTPUT){
+    self->port[pin] = (mode == INPUT_PULLUP);
+  }
+  updateNet(netOf(pin));
+}
+
+void digitalWrite(uint8 pin, uint8 value)
+{
+  simAdvance(COST_DIGITAL_WRITE);
+  self->port[pin] = (value != LOW);
+  updateNet(netOf(pin));
+}
+
+int digitalRead(uint8 pin)
+{
+  simAdvance(COST_DIGITAL_READ);
+  return(bus->net[netOf(pin)]);
+}
+
+void delay(unsigned long ms)
+{
+  simAdvance((uint64)ms * CYCLES_PER_US * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  simAdvance((uint64)us * CYCLES_PER_US);
+}
+
+unsigned long micros()
+{
+  simAdvance(COST_MICROS);
+  return(self ? self->now / CYCLES_PER_US : 0);
+}
+
+unsigned long millis()
+{
+  simAdvance(COST_MICROS);
+  return(self ? self->now / (CYCLES_PER_US * 1000) : 0);
+}
+
+void interrupts()
+{
+  self->sreg = 1;
+  simAdvance(1); // Let anything pending run
+}
+
+void noInterrupts()
+{
+  self->sreg = 0;
+  simAdvance(1);
+}
+
+// Lets anything pending run, if interrupts are off, and turns them off again
+void simInterruptWindow()
+{
+  if(!self->sreg){
+    interrupts();
+    noInterrupts();
+  }
+}
+
+void simIrqEnable(SimVector vector, bool enable)
+{
+  if(enable){
+    self->irqEnabled |= 1UL << vector;
+  }
+  else{
+    self->irqEnabled &= ~(1UL << vector);
+    self->irqPending &= ~(1UL << vector);
+  }
+}
+
+bool simReadPin(uint8 pin)
+{
+  // A port read takes a single cycle, so sample before spending the rest
+  bool level = bus->net[netOf(pin)];
+  simAdvance(COST_PIN_READ);
+  return(level);
+}
+
+void simWritePin(uint8 pin, bool high)
+{
+  simAdvance(COST_PORT_WRITE);
+  self->port[pin] = high;
+  updateNet(netOf(pin));
+}
+
+void simPinOutput(uint8 pin, bool output)
+{
+  simAdvance(COST_PORT_WRITE);
+  self->dir[pin] = output;
+  updateNet(netOf(pin));
+}
+
+void simSpiSlaveEnable(bool enable)
+{
+  simAdvance(COST_SPI_REG);
+  SimSpi& spi = self->spi;
+  if(enable && !spi.enabled){
+    spi.bits = 0; // Enabling the SPI resets the bit counter
+  }
+  spi.enabled = enable;
+  spi.master = 0;
+  spi.edgesLeft = 0;
+  simIrqEnable(SPI_STC_vect, false); // SPIE is part of the same register
+  updateNet(DATA_MISO);
+  updateNet(CLK);
+}
+
+void simSpiMasterEnable(uint8 clock)
+{
+  static const uint32 dividers[4] = {4, 16, 64, 128}; // SPR1:SPR0
+  simAdvance(COST_SPI_REG);
+  SimSpi& spi = self->spi;
+  uint32 divider = dividers[clock & 0x03];
+  if(clock & 0x04){
+    divider /= 2; // SPI2X
+  }
+  spi.enabled = 1;
+  spi.master = 1;
+  spi.sck = 1; // CPOL = 1
+  spi.bits = 0;
+  spi.edgesLeft = 0;
+  spi.halfPeriod = divider / 2;
+  simIrqEnable(SPI_STC_vect, false);
+  updateNet(DATA_MISO);
+  updateNet(CLK);
+}
+
+void simSpiInterruptEnable(bool enable)
+{
+  simAdvance(COST_SPI_REG);
+  simIrqEnable(SPI_STC_vect, enable);
+  if(enable && self->spi.spif){
+    simRaise(*self, SPI_STC_vect);
+  }
+}
+
+void simSpiWrite(uint8 value)
+{
+  simAdvance(COST_SPI_REG);
+  SimSpi& spi = self->spi;
+  if(spi.spifSeen){
+    spi.spif = spi.spifSeen = 0;
+  }
+  // Writing in the middle of a transfer is a collision and is ignored
+  if(spi.bits == 0 && spi.edgesLeft == 0){
+    spi.shift = value;
+    spi.out = value & 0x01;
+    updateNet(DATA_MISO);
+    if(spi.enabled && spi.master){
+      // Writing SPDR starts the clock
+      spi.edgesLeft = 16;
+      spi.nextEdge = self->now + spi.halfPeriod;
+    }
+  }
+}
+
+uint8 simSpiRead()
+{
+  simAdvance(COST_SPI_REG);
+  SimSpi& spi = self->spi;
+  if(spi.spifSeen){
+    spi.spif = spi.spifSeen = 0;
+  }
+  return(spi.rx);
+}
+
+bool simSpiDone()
+{
+  simAdvance(COST_PIN_READ);
+  self->spi.spifSeen = self->spi.spif;
+  return(self->spi.spif);
+}
+
+// Timer 1 running at F_CPU / 8
+uint16 simTicks()
+{
+  simAdvance(COST_TIMER_READ);
+  return(self ? (uint16)(self->now / 8) : 0);
+}
+
+/* Sets an output compare on timer 1 and enables its interrupt, or disables
+ * it.  Like the hardware, a count that already equals the compare value
+ * doesn't match until it comes round again. */
+void simTickAlarm(uint8 channel, uint16 at, bool enable)
+{
+  simAdvance(COST_SPI_REG);
+  SimTimer& timer = self->timer;
+  SimVector vector = channel == 0 ? TIMER1_COMPA_vect : TIMER1_COMPB_vect;
+  timer.enabled[channel] = enable;
+  simIrqEnable(vector, false); // Clears anything already pending, like writing TIFR1
+  if(enable){
+    uint64 count = self->now / 8;
+    timer.match[channel] = (count + (uint16)(at - (uint16)count - 1) + 1) * 8;
+    simIrqEnable(vector, true);
+  }
+}
+
+void simSpin()
+{
+  simAdvance(COST_PIN_READ);
+}
+
+void simUartBegin(uint32 baud)
+{
+  simAdvance(COST_SPI_REG);
+  self->uart.charCycles = F_CPU_HZ * 10 / baud; // Start + 8 data + stop bits
+  self->uart.busy = 0;
+}
+
+// Writing UDR1 while the transmitter is busy would lose the byte, as here
+void simUartWrite(uint8 value)
+{
+  simAdvance(COST_SPI_REG);
+  SimUart& uart = self->uart;
+  if(uart.busy){
+    return;
+  }
+  if(uartOut){
+    fputc(value, uartOut);
+  }
+  uart.busy = 1;
+  uart.txDone = self->now + uart.charCycles;
+}
+
+// RXEN and RXCIE together, since we only ever receive by interrupt
+void simUartReceiveEnable(bool enable)
+{
+  simAdvance(COST_SPI_REG);
+  SimUart& uart = self->uart;
+  simIrqEnable(USART1_RX_vect, enable);
+  if(enable && !uart.rxEnabled){
+    uart.rxNext = self->now + uart.charCycles;
+  }
+  uart.rxEnabled = enable;
+}
+
+/* Takes the oldest byte from the receive buffer.  The interrupt keeps
+ * coming for as long as there are any left, as RXC1 does. */
+uint8 simUartRead()
+{
+  simAdvance(COST_SPI_REG);
+  SimUart& uart = self->uart;
+  uint8 value = uart.rx[0];
+  if(uart.rxCount){
+    uart.rxCount--;
+    memmove(uart.rx, uart.rx + 1, uart.rxCount);
+  }
+  uart.overrun = 0;
+  if(uart.rxCount){
+    simRaise(*self, USART1_RX_vect);
+  }
+  return(value);
+}
+
+bool simUartOverrun()
+{
+  simAdvance(COST_SPI_REG);
+  return(self->uart.overrun);
+}
+
+// UDRIE.  The interrupt comes whenever the transmitter is free while it's set.
+void simUartInterruptEnable(bool enable)
+{
+  simAdvance(COST_SPI_REG);
+  simIrqEnable(USART1_UDRE_vect, enable);
+  if(enable && !self->uart.busy){
+    simRaise(*self, USART1_UDRE_vect);
+  }
+}
+
+void simEepromRead(uint16 addr, uint8* buf, uint16 n)
+{
+  for(uint16 i = 0; i < n; i++){
+    simAdvance(COST_EEPROM_READ);
+    buf[i] = eeprom[(addr + i) % SIM_EEPROM_BYTES];
+  }
+}
+
+/* Like eeprom_update_block(), only the bytes that differ are written, and
+ * each one takes the full programming time.  The whole image goes back to
+ * MFT_SIM_EEPROM afterwards. */
+void simEepromUpdate(uint16 addr, const uint8* buf, uint16 n)
+{
+  bool changed = false;
+  for(uint16 i = 0; i < n; i++){
+    uint8& cell = eeprom[(addr + i) % SIM_EEPROM_BYTES];
+    simAdvance(COST_EEPROM_READ);
+    if(cell != buf[i]){
+      simAdvance(COST_EEPROM_WRITE);
+      cell = buf[i];
+      changed = true;
+    }
+  }
+  if(changed && eepromFile){
+    FILE* f = fopen(eepromFile, "wb");
+    if(!f || fwrite(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom)){
+      perror("mftsim: MFT_SIM_EEPROM");
+    }
+    if(f){
+      fclose(f);
+    }
+  }
+}
+
+/* Serial output is queued through a virtual 64-byte buffer which drains at
+ * the baud rate, so heavy printing stalls the caller just like on the AVR. */
+static uint64 txIdle = 0; // Time at which the transmit buffer is empty
+
+void SimSerial::begin(unsigned long baud)
+{
+  baud_ = baud;
+  rx_ = -1;
+  eof_ = false;
+}
+
+/* Input isn't paced at all: a byte is available as soon as it can be read
+ * from stdin, without blocking. */
+int SimSerial::available()
+{
+  simAdvance(COST_SERIAL_CHAR);
+  if(rx_ < 0 && !eof_){
+    struct pollfd p = {0, POLLIN, 0};
+    uint8 c;
+    if(poll(&p, 1, 0) == 1){
+      if(::read(0, &c, 1) == 1){
+        rx_ = c;
+      }
+      else{
+        eof_ = true;
+      }
+    }
+  }
+  return(rx_ < 0 ? 0 : 1);
+}
+
+int SimSerial::read()
+{
+  if(!available()){
+    return(-1);
+  }
+  int c = rx_;
+  rx_ = -1;
+  return(c);
+}
+
+size_t SimSerial::write(uint8 c)
+{
+  if(self && baud_){
+    uint64 charCycles = F_CPU_HZ * 10 / baud_; // Start + 8 data + stop bits
+    uint64 full = 63 * charCycles;
+    if(txIdle > self->now + full){
+      simAdvance(txIdle - self->now - full); // Wait for space in the buffer
+    }
+    txIdle = (txIdle > self->now ? txIdle : self->now) + charCycles;
+  }
+  putchar(c);
+  simAdvance(COST_SERIAL_CHAR);
+  return(1);
+}
+
+size_t SimSerial::write(const uint8* buf, size_t n)
+{
+  for(size_t i = 0; i < n; i++){
+    write(buf[i]);
+  }
+  return(n);
+}
+
+size_t SimSerial::write(const char* str)
+{
+  return(write((const uint8*)str, strlen(str)));
+}
+
+size_t SimSerial::printNumber(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char* str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if(base < 2){
+    base = 10;
+  }
+  do{
+    char c = n % base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while(n);
+  return(write(str));
+}
+
+size_t SimSerial::print(const char* str) { return(write(str)); }
+size_t SimSerial::print(const __FlashStringHelper* str) { return(write((const char*)str)); }
+size_t SimSerial::print(char c) { return(write((uint8)c)); }
+size_t SimSerial::print(unsigned char n, int base) { return(printNumber(n, base)); }
+size_t SimSerial::print(int n, int base) { return(print((long)n, base)); }
+size_t SimSerial::print(unsigned int n, int base) { return(printNumber(n, base)); }
+size_t SimSerial::print(unsigned long n, int base) { return(printNumber(n, base)); }
+
+size_t SimSerial::print(long n, int base)
+{
+  if(base == 10 && n < 0){
+    return(write('-') + printNumber(-n, 10));
+  }
+  return(printNumber(n, base));
+}
+
+size_t SimSerial::println(void) { return(write("\r\n")); }
+size_t SimSerial::println(const char* str) { return(print(str) + println()); }
+size_t SimSerial::println(const __FlashStringHelper* str) { return(print(str) + println()); }
+size_t SimSerial::println(char c) { return(print(c) + println()); }
+size_t SimSerial::println(unsigned char n, int base) { return(print(n, base) + println()); }
+size_t SimSerial::println(int n, int base) { return(print(n, base) + println()); }
+size_t SimSerial::println(unsigned int n, int base) { return(print(n, base) + println()); }
+size_t SimSerial::println(long n, int base) { return(print(n, base) + println()); }
+size_t SimSerial::println(unsigned long n, int base) { return(print(n, base) + println()); }
+
+#endif /* MFT_HOST */
@@ -0,0 +1,151 @@
+/* sim.h
+ * Host-side stand-in for the Arduino core and the MFT bus hardware.
+ *
+ * Each program (fakebody, fakelens, ...) built with -DMFT_HOST attaches to a
+ * shared-memory bus and runs as its own process.  Every bus access costs a
+ * plausible number of AVR clock cycles on a virtual 16 MHz clock, and the
+ * processes take turns so that whichever is furthest behind in virtual time
+ * always runs next.  Timing measured in the simulator is therefore
+ * deterministic and independent of how the host schedules the processes.
+ *
+ * Environment variables:
+ *   MFT_BUS        Name of the shared-memory bus (default "/mftbus")
+ *   MFT_SIM_PEERS  Number of processes to wait for before starting (default 2)
+ *   MFT_SIM_MS     Stop after this many milliseconds of virtual time
+ *   MFT_SIM_TRACE  If set, log every edge on the bus to stderr
+ *   MFT_SIM_UART1  File to write whatever goes out of the second serial port
+ *   MFT_SIM_UART1_IN  File or pipe to feed into the second serial port
+ *   MFT_SIM_EEPROM File holding the EEPROM contents from one run to the next
+ *   MFT_SIM_CAPTURE  File to write every change on CLK, DATA, BODY_ACK and
+ *                  LENS_ACK to, as a logic analyzer CSV export (see decode.cpp)
+ *
+ * When the last process detaches, bus statistics (handshake latency, bytes
+ * transferred, shutter pulses) are printed to stderr.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "typedef.h"
+#include "progmem.h" // Program memory is just memory here
+
+// Arduino core constants
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+// Arduino core functions
+void init();
+void pinMode(uint8 pin, uint8 mode);
+void digitalWrite(uint8 pin, uint8 value);
+int digitalRead(uint8 pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long micros();
+unsigned long millis();
+void interrupts();
+void noInterrupts();
+
+/* Interrupt vectors, lowest number first when several are pending.  Handlers
+ * are written with the usual ISR(vector) from avr/interrupt.h, which hooks
+ * them into the simulator at startup. */
+enum SimVector
+{
+  BODY_ACK_vect, // Pin change on BODY_ACK
+  TIMER1_COMPA_vect, // Timer 1 output compares
+  TIMER1_COMPB_vect,
+  SPI_STC_vect, // SPI transfer complete
+  USART1_RX_vect, // Second serial port received a byte
+  USART1_UDRE_vect, // Second serial port ready for another byte
+  SIM_VECTORS
+};
+
+typedef void (*SimIsr)(void);
+
+struct SimIsrHook
+{
+  SimIsrHook(SimVector vector, SimIsr isr);
+};
+
+#define ISR(vector) \
+  static void vector##_handler(); \
+  static SimIsrHook vector##_hook(vector, vector##_handler); \
+  static void vector##_handler()
+
+/* Strings wrapped in F() stay in program memory on the AVR, and print from
+ * there.  Here they're ordinary strings with a different type. */
+class __FlashStringHelper;
+#define F(string) ((const __FlashStringHelper*)(string))
+
+/* Serial port.  Output goes to stdout, paced at the virtual baud rate
+ * through a 64-byte transmit buffer like the real HardwareSerial.  Input
+ * comes from stdin, whenever it turns up. */
+class SimSerial
+{
+public:
+  void begin(unsigned long baud);
+  int available();
+  int read();
+  size_t write(uint8 c);
+  size_t write(const char* str);
+  size_t write(const uint8* buf, size_t n);
+  size_t print(const char* str);
+  size_t print(const __FlashStringHelper* str);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t println(void);
+  size_t println(const char* str);
+  size_t println(const __FlashStringHelper* str);
+  size_t println(char c);
+  size_t println(unsigned char n, int base = DEC);
+  size_t println(int n, int base = DEC);
+  size_t println(unsigned int n, int base = DEC);
+  size_t println(long n, int base = DEC);
+  size_t println(unsigned long n, int base = DEC);
+
+private:
+  size_t printNumber(unsigned long n, int base);
+  unsigned long baud_;
+  int rx_; // Byte read ahead by available(), or -1
+  bool eof_;
+};
+
+extern SimSerial Serial;
+
+// Simulated bus primitives, used by the host side of hal.h
+bool simReadPin(uint8 pin);
+void simWritePin(uint8 pin, bool high);
+void simPinOutput(uint8 pin, bool output);
+void simSpiSlaveEnable(bool enable);
+void simSpiMasterEnable(uint8 clock);
+void simSpiInterruptEnable(bool enable);
+void simIrqEnable(SimVector vector, bool enable);
+void simSpiWrite(uint8 value);
+uint8 simSpiRead();
+bool simSpiDone();
+uint16 simTicks();
+void simTickAlarm(uint8 channel, uint16 at, bool enable);
+void simSpin();
+void simUartBegin(uint32 baud);
+void simUartWrite(uint8 value);
+void simUartInterruptEnable(bool enable);
+void simUartReceiveEnable(bool enable);
+uint8 simUartRead();
+bool simUartOverrun();
+void simInterruptWindow();
+void simEepromRead(uint16 addr, uint8* buf, uint16 n);
+void simEepromUpdate(uint16 addr, const uint8* buf, uint16 n);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,364 @@
+/* sniffer.cpp
+ * Code that sits between a real body and lens, with every line an input,
+ * and streams the transactions going past out of TX1.
+ *
+ * Like fakelens, it runs entirely from two interrupts: a pin change on
+ * BODY_ACK, which starts each transaction, and SPI transfer complete, which
+ * takes each byte in whichever direction it's going.  Since the data line
+ * is shared, the slave SPI hardware sees the bytes from both sides, and the
+ * command kinds in commands.h say where each transaction ends.  Both
+ * handlers read timer 1 before anything else, so transactions are timed to
+ * the tick from when the edges happened rather than from when we got round
+ * to them.
+ *
+ * Finished transactions go into a small queue that the main loop sends on
+ * as TELEMETRY_TRACE frames, in the same layout as fakebody's recorder (see
+ * recorder.h), so the same host tools read both.  Nothing is ever driven:
+ * MISO stays an input, so the SPI hardware can't put anything on the bus.
+ */
+
+#include "typedef.h"
+#include "common.h"
+#include "hal.h"
+#include "telemetry.h"
+#include "recorder.h"
+#include "commands.h"
+#include "memory.h"
+
+/* If the bus stops partway through a transaction for this long, we give up
+ * on it.  The extra handshake before the single byte of a KIND_BYTE command
+ * has a long pause in it, so it gets longer. */
+#define TRANSACTION_TIMEOUT_US 2000
+#define HANDSHAKE_TIMEOUT_MS 1000
+
+// Once we're lost, the bus has to be quiet this long before we start again
+#define LOST_QUIET_US 500
+
+// How long to look out for the clock to drop after CMD_CLOCK_RESET
+#define CLOCK_RESET_TIMEOUT_US 5000
+
+// Transactions waiting to go out.  Must be a power of 2.
+#define SNIFF_QUEUE 8
+
+/* Where we are in a transaction.  Each state is named after what we are
+ * waiting for next. */
+enum SnifferState {
+  IDLE, // BODY_ACK to rise, starting a command
+  COMMAND, // The command and its checksum
+  PACKET, // A packet in either direction, up to its checksum
+  BYTE, // The single byte after the extra handshake
+  CLOCK_RESET, // As IDLE, but the clock may drop first (see main())
+  LOST // A quiet bus, after something we couldn't follow
+};
+
+struct Sniffed
+{
+  uint8 length; // Of the record
+  uint8 record[RECORD_HEADER + RECORD_MAX_DATA]; // See recorder.h
+};
+
+// Where the fields of a record are
+#define FIELD_FLAGS 0
+#define FIELD_TIME 1
+#define FIELD_DURATION 5
+#define FIELD_COMMAND 7
+
+/* Only the interrupts move queueHead and only the main loop moves
+ * queueTail.  The transaction in progress is built in place in the slot at
+ * queueHead, or in spare if the queue is full. */
+Sniffed queue[SNIFF_QUEUE];
+volatile uint8 queueHead = 0;
+volatile uint8 queueTail = 0;
+Sniffed spare;
+Sniffed* current;
+
+// Transaction state, shared between the two interrupt handlers
+volatile SnifferState state = IDLE;
+Frame rx;
+uint8 recordFlags; // RECORD_SENT or RECORD_UNKNOWN, before we know if it was OK
+uint16 startTicks; // At the BODY_ACK rise
+uint16 lastTicks; // At the last byte
+uint32 startUs;
+uint32 byteWaitStart; // millis() at the start of a BYTE wait
+uint32 clockResetStart; // micros() at the start of a CLOCK_RESET wait
+bool clockDropped;
+
+// Bumped by both interrupt handlers, so the main loop can tell when a
+// transaction has stalled
+volatile uint8 busActivity = 0;
+
+// Counts, for the main loop to report
+volatile uint32 transactions = 0;
+volatile uint16 badTransactions = 0; // Checksums that didn't match
+volatile uint16 abandoned = 0; // Stalled partway through
+volatile uint16 dropped = 0; // No room in the queue
+
+void setup() {
+  Serial.begin(115200);
+  pinMode(SLEEP, INPUT);
+  pinMode(BODY_ACK, INPUT);
+  pinMode(BODY_ACK_INT, INPUT);
+  pinMode(LENS_ACK, INPUT);
+  pinMode(FOCUS, INPUT);
+  pinMode(SHUTTER, INPUT);
+  pinMode(CLK, INPUT);
+  pinMode(DATA_MISO, INPUT);
+  pinMode(DATA_MOSI, INPUT);
+}
+
+/* Turns the SPI off and on again, which resets its bit count, so that it's
+ * in step with the next byte.  It has to be on before the next command
+ * starts: the body may start clocking as soon as the lens is ready, and our
+ * interrupt is no quicker than the lens's. */
+void armSpi()
+{
+  spiDisable();
+  spiSlaveEnable();
+  spiInterruptEnable();
+}
+
+// Starts a transaction at the BODY_ACK rise, in the next free queue slot
+void beginTransaction(uint16 now)
+{
+  current = (uint8)(queueHead - queueTail) < SNIFF_QUEUE ?
+            &queue[queueHead & (SNIFF_QUEUE - 1)] : &spare;
+  startTicks = lastTicks = now;
+  startUs = micros();
+  recordFlags = 0;
+  frameBeginCommand(rx, &current->record[FIELD_COMMAND]);
+  state = COMMAND;
+}
+
+/* Finishes the record for the current transaction and queues it, and gets
+ * ready for the next one.  Runs with interrupts off. */
+void endTransaction(uint8 flags, uint16 nBytes, SnifferState next)
+{
+  if(next == IDLE || next == CLOCK_RESET){
+    armSpi();
+  }
+  else{
+    spiDisable(); // Until we know where the bytes start again
+  }
+  state = next;
+  transactions++;
+  if(!(flags & RECORD_OK)){
+    badTransactions++;
+  }
+
+  uint8* r = current->record;
+  // Only the power-up handshake is too long for the ticks to cover
+  uint16 duration = micros() - startUs > 30000 ? 0xffff : lastTicks - startTicks;
+  r[FIELD_FLAGS] = flags | recordFlags;
+  for(uint8 i = 0; i < 4; i++){
+    r[FIELD_TIME + i] = startUs >> (8 * i);
+  }
+  r[FIELD_DURATION] = duration;
+  r[FIELD_DURATION + 1] = duration >> 8;
+  current->length = RECORD_HEADER + (nBytes < RECORD_MAX_DATA ? nBytes : RECORD_MAX_DATA);
+
+  if(current == &spare){
+    dropped++;
+  }
+  else{
+    queueHead++; // Only now can the main loop see it
+  }
+}
+
+/* Drops whatever transaction is in progress and goes back to waiting for a
+ * command.  Runs with interrupts off. */
+void abandonTransaction()
+{
+  if((state == COMMAND && rx.index > 2) || state == PACKET || state == BYTE){
+    abandoned++;
+    endTransaction(RECORD_TIMEOUT, state == PACKET && rx.index > 2 ? rx.index - 2 : 0, IDLE);
+  }
+  armSpi();
+  state = IDLE;
+}
+
+ISR(BODY_ACK_vect)
+{
+  uint16 now = ticks();
+  busActivity++;
+  bool high = bodyAckHigh();
+
+  if((state == IDLE || state == CLOCK_RESET) && high){
+    beginTransaction(now);
+  }
+  else if(state == COMMAND && rx.index == 2){
+    // The wake-up handshake raises and drops BODY_ACK without a command, so
+    // nothing counts until the first byte arrives
+    if(high){
+      startTicks = lastTicks = now;
+      startUs = micros();
+    }
+    else{
+      state = IDLE;
+    }
+  }
+}
+
+ISR(SPI_STC_vect)
+{
+  uint16 now = ticks();
+  uint8 value = spiRead();
+  busActivity++;
+  lastTicks = now;
+
+  if(state == IDLE || state == CLOCK_RESET){
+    endTransaction(0, 0, LOST); // A byte outside of any transaction
+  }
+  else if(state == COMMAND){
+    FrameStatus status = framePutByte(rx, value);
+    if(status == FRAME_MORE){
+      return;
+    }
+    if(status != FRAME_OK){
+      endTransaction(0, 0, LOST);
+      return;
+    }
+
+    uint32 command = commandFromBytes(&current->record[FIELD_COMMAND]);
+    CommandKind kind = commandKind(command);
+    if(kind == KIND_UNKNOWN){
+      // We can't tell where it ends, so wait for it to be over
+      recordFlags = RECORD_UNKNOWN;
+      endTransaction(RECORD_OK, 0, LOST);
+    }
+    else if(command == CMD_CLOCK_RESET){
+      clockResetStart = micros();
+      clockDropped = false;
+      endTransaction(RECORD_OK, 0, CLOCK_RESET);
+    }
+    else if(kind == KIND_NONE){
+      endTransaction(RECORD_OK, 0, IDLE);
+    }
+    else if(kind == KIND_BYTE){
+      byteWaitStart = millis();
+      state = BYTE;
+    }
+    else{
+      recordFlags = kind == KIND_PACKET ? RECORD_SENT : 0;
+      frameBeginWatch(rx, &current->record[RECORD_HEADER], RECORD_MAX_DATA);
+      state = PACKET;
+    }
+  }
+  else if(state == PACKET){
+    FrameStatus status = framePutByte(rx, value);
+    if(status != FRAME_MORE){
+      endTransaction(status == FRAME_OK ? RECORD_OK : 0, framePayloadBytes(rx),
+                     status == FRAME_OK ? IDLE : LOST);
+    }
+  }
+  else if(state == BYTE){
+    current->record[RECORD_HEADER] = value;
+    endTransaction(RECORD_OK, 1, IDLE);
+  }
+}
+
+// Sends on as many finished transactions as there's room for
+void sendQueued()
+{
+  while(queueTail != queueHead){
+    Sniffed& s = queue[queueTail & (SNIFF_QUEUE - 1)];
+    if(telemetryRoom() < s.length){
+      break;
+    }
+    telemetrySend(TELEMETRY_TRACE, s.record, s.length);
+    queueTail++;
+  }
+}
+
+int main()
+{
+  init(); // Arduino library init
+  setup(); // Pin setup
+  tickTimerStart();
+  telemetryBegin();
+
+  uint32 lastReport = millis();
+  uint32 reported = 0;
+
+  while(1){
+    // The lens is off, and its lines with it, until the body wakes it
+    while(digitalRead(SLEEP) == 0){
+      sendQueued();
+    }
+    armSpi();
+    bodyAckInterruptEnable();
+
+    uint8 lastActivity = busActivity;
+    uint32 lastActive = micros();
+
+    while(digitalRead(SLEEP)){
+      /* The body may drop the clock for a ms after CMD_CLOCK_RESET, which
+       * shifts a stray bit into the SPI hardware when it comes back up.  It
+       * takes its time about it, so we can watch for it from here and start
+       * the SPI again afterwards.  If the next command starts instead,
+       * there was no drop. */
+      noInterrupts();
+      if(state == CLOCK_RESET){
+        if(!clkHigh()){
+          clockDropped = true;
+        }
+        else if(clockDropped){
+          armSpi();
+          state = IDLE;
+        }
+        else if(micros() - clockResetStart > CLOCK_RESET_TIMEOUT_US){
+          state = IDLE;
+        }
+      }
+
+      // Give up on a transaction which has stopped moving, or come back from
+      // being lost once the bus has gone quiet
+      if(state == IDLE || state == CLOCK_RESET || busActivity != lastActivity){
+        lastActivity = busActivity;
+        lastActive = micros();
+      }
+      else if(state == LOST ? micros() - lastActive > LOST_QUIET_US :
+              state == BYTE ? millis() - byteWaitStart > HANDSHAKE_TIMEOUT_MS :
+              micros() - lastActive > TRANSACTION_TIMEOUT_US){
+        abandonTransaction();
+      }
+      interrupts();
+
+      sendQueued();
+
+      // Send an 'm' for the SRAM usage
+      if(Serial.available() && Serial.read() == 'm'){
+        memoryReport();
+      }
+
+      if(millis() - lastReport >= 1000){
+        lastReport = millis();
+        noInterrupts();
+        uint32 n = transactions;
+        uint16 bad = badTransactions;
+        uint16 stalled = abandoned;
+        uint16 lost = dropped;
+        interrupts();
+        if(n != reported){
+          reported = n;
+          Serial.print(F("Transactions: "));
+          Serial.print(n);
+          Serial.print(F(", bad "));
+          Serial.print(bad);
+          Serial.print(F(", abandoned "));
+          Serial.print(stalled);
+          Serial.print(F(", dropped "));
+          Serial.println(lost);
+        }
+      }
+    }
+
+    // Turned off
+    bodyAckInterruptDisable();
+    noInterrupts();
+    abandonTransaction();
+    spiDisable();
+    interrupts();
+  }
+
+  return(0);
+}
@@ -0,0 +1,47 @@
+/* standby.cpp
+ * Unit conversions for the standby packet fields, and the snapshot setup.
+ * The conversions are all integer arithmetic, since floating point is slow
+ * and large on the AVR.
+ */
+
+#include <string.h>
+#include "standby.h"
+#include "progmem.h"
+
+// 2^(i/16) in 8.8 fixed point, for i = 0 to 16
+static const uint16 pow2Sixteenths[17] PROGMEM = {
+  256, 267, 279, 292, 304, 318, 332, 347, 362,
+  378, 395, 412, 431, 450, 470, 490, 512
+};
+
+/* Converts an aperture value in 1/256 EV to ten times the f-number, which
+ * is 2^(Av/2), rounded.  Interpolating the table linearly is good to a
+ * fraction of a percent.  Anything from f/128 up comes back as 0xffff. */
+uint16 apertureFNumber10(uint16 av)
+{
+  // Av/2 in 1/256 steps: whole part is a shift, the fraction is from the table
+  uint8 shift = av >> 9;
+  uint16 frac = av & 0x1ff;
+  if(shift > 6){
+    return(0xffff);
+  }
+  uint8 i = frac >> 5;
+  uint16 lo = pgm_read_word(&pow2Sixteenths[i]);
+  uint16 hi = pgm_read_word(&pow2Sixteenths[i + 1]);
+  uint16 p = lo + (((hi - lo) * (frac & 0x1f)) >> 5);
+  return(((uint32)p * 10 << shift) + 128) >> 8;
+}
+
+// Fills both copies of a snapshot with the same packet, from program memory
+void standbySnapshotBegin(StandbySnapshot& s, const uint8* initial)
+{
+  memcpy_P(s.bytes[0], initial, STANDBY_BYTES);
+  memcpy(s.bytes[1], s.bytes[0], STANDBY_BYTES);
+  uint8 sum = 0;
+  for(uint8 i = 0; i < STANDBY_BYTES; i++){
+    sum += s.bytes[0][i];
+  }
+  s.checksum[0] = s.checksum[1] = sum;
+  s.front = 0;
+  s.sending = STANDBY_NONE;
+}
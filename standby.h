@@ -0,0 +1,131 @@
+/* standby.h
+ * Field layout of the standby packet, which the lens sends in answer to
+ * C1 80 01 06 (or C1 80 01 02) about once a frame.
+ *
+ * A StandbyView is just a pointer to the payload where it already is, with
+ * accessors for each field, so reading or changing a field never copies the
+ * packet.  Multi-byte fields are LSB first, like everything else on the bus.
+ */
+
+#ifndef STANDBY_H_
+#define STANDBY_H_
+
+#include "typedef.h"
+
+// Payload bytes, not counting the length or checksum
+#define STANDBY_BYTES 30
+
+// Byte offsets of the fields we know something about
+#define STANDBY_STATUS 0 // 4 bytes
+#define STANDBY_RAW_ZOOM 4
+#define STANDBY_RAW_FOCUS 5
+#define STANDBY_FOCUS_DISTANCE 6 // 2 bytes
+#define STANDBY_APERTURE 8 // 2 bytes
+#define STANDBY_SCALED_ZOOM 10 // 2 bytes
+#define STANDBY_FOCUS_POSITION 12 // 2 bytes, raw focus again?
+
+struct StandbyView
+{
+  uint8* bytes;
+};
+
+inline StandbyView standbyView(uint8* bytes)
+{
+  StandbyView v = {bytes};
+  return(v);
+}
+
+inline uint16 standbyField16(StandbyView v, uint8 offset)
+{
+  return(v.bytes[offset] | (v.bytes[offset + 1] << 8));
+}
+
+inline void standbySetField16(StandbyView v, uint8 offset, uint16 value)
+{
+  v.bytes[offset] = value;
+  v.bytes[offset + 1] = value >> 8;
+}
+
+inline uint32 standbyStatus(StandbyView v)
+{
+  return((uint32)standbyField16(v, STANDBY_STATUS) |
+         ((uint32)standbyField16(v, STANDBY_STATUS + 2) << 16));
+}
+
+inline uint8 standbyRawZoom(StandbyView v) { return(v.bytes[STANDBY_RAW_ZOOM]); }
+inline uint8 standbyRawFocus(StandbyView v) { return(v.bytes[STANDBY_RAW_FOCUS]); }
+inline uint16 standbyFocusDistance(StandbyView v) { return(standbyField16(v, STANDBY_FOCUS_DISTANCE)); }
+inline uint16 standbyScaledZoom(StandbyView v) { return(standbyField16(v, STANDBY_SCALED_ZOOM)); }
+inline uint16 standbyFocusPosition(StandbyView v) { return(standbyField16(v, STANDBY_FOCUS_POSITION)); }
+
+/* Effective aperture, which looks like an APEX aperture value in 1/256 EV
+ * steps: 0x03b1 is Av 3.69, or f/3.6, for a lens that opens up to f/3.5.
+ * The aperture command takes the same units. */
+inline uint16 standbyAperture(StandbyView v) { return(standbyField16(v, STANDBY_APERTURE)); }
+
+inline void standbySetAperture(StandbyView v, uint16 av)
+{
+  standbySetField16(v, STANDBY_APERTURE, av);
+}
+
+uint16 apertureFNumber10(uint16 av);
+
+/* A standby packet that is updated from the main loop while the bus
+ * interrupt sends it, without either one holding the other off.
+ *
+ * There are two copies.  The bus takes the front one at the start of a
+ * packet and keeps it until the transaction is over; the updater writes the
+ * back one and then swaps them over, which is a single byte store.  If the
+ * bus is still sending what has since become the back copy, the update is
+ * put off until next time.  The back copy is two versions old, so the
+ * updater has to put every field it owns each time, but writing a field
+ * that hasn't changed costs only the comparison.  The checksum of each copy
+ * is kept up to date byte by byte as fields change, so sending it never
+ * has to add up the whole packet. */
+#define STANDBY_NONE 0xff
+
+struct StandbySnapshot
+{
+  uint8 bytes[2][STANDBY_BYTES];
+  uint8 checksum[2]; // Of each payload
+  volatile uint8 front; // Copy the bus sends next
+  volatile uint8 sending; // Copy the bus is in the middle of, or STANDBY_NONE
+};
+
+void standbySnapshotBegin(StandbySnapshot& s, const uint8* initial);
+
+// Bus side.  Takes the front copy for a packet, or lets it go again.
+inline uint8 standbyTake(StandbySnapshot& s)
+{
+  uint8 f = s.front;
+  s.sending = f;
+  return(f);
+}
+
+inline void standbyRelease(StandbySnapshot& s) { s.sending = STANDBY_NONE; }
+
+// Updater side.  Returns false if the back copy can't be written just now.
+inline bool standbyBeginUpdate(StandbySnapshot& s)
+{
+  return(s.sending != (s.front ^ 1));
+}
+
+inline void standbyPut8(StandbySnapshot& s, uint8 offset, uint8 value)
+{
+  uint8 back = s.front ^ 1;
+  uint8& old = s.bytes[back][offset];
+  if(old != value){
+    s.checksum[back] += value - old;
+    old = value;
+  }
+}
+
+inline void standbyPut16(StandbySnapshot& s, uint8 offset, uint16 value)
+{
+  standbyPut8(s, offset, value);
+  standbyPut8(s, offset + 1, value >> 8);
+}
+
+inline void standbyPublish(StandbySnapshot& s) { s.front ^= 1; }
+
+#endif /* STANDBY_H_ */
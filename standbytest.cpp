@@ -0,0 +1,88 @@
+/* standbytest.cpp
+ * Host-side check of the StandbyView accessors and unit conversions in
+ * standby.h against a standby packet captured from a real lens.  Build and
+ * run it on the host along with the simulator (see the README); it prints
+ * each check that fails, and exits with 1 if any did.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "standby.h"
+
+// The response as it came off the bus: the high byte of the length, and
+// then the payload
+static const uint8 dump[31] = {0x00,
+  0xc2, 0xe1, 0x00, 0x00, // Status
+  0x00, 0x0c, // 4/5: Raw zoom, raw focus
+  0x42, 0x00, // 6/7: Focus distance
+  0xb1, 0x03, // 8/9: Effective aperture
+  0x00, 0x0c, // 10/11: Scaled zoom
+  0x0c, 0x00, // 12-13: raw focus?
+  0xd2, 0x00, 0x2f, 0x01, 0x8c, 0x01, 0xea, 0x01,
+  0x47, 0x02, 0xa4, 0x5c, 0x03, 0x4e, 0x02};
+
+static int failures = 0;
+
+#define CHECK(got, expected) check(#got, (got), (expected))
+
+static void check(const char* what, unsigned long got, unsigned long expected)
+{
+  if(got != expected){
+    printf("%s: got 0x%lx, expected 0x%lx\n", what, got, expected);
+    failures++;
+  }
+}
+
+int main()
+{
+  uint8 payload[STANDBY_BYTES];
+  memcpy(payload, dump + 1, STANDBY_BYTES);
+  StandbyView v = standbyView(payload);
+
+  CHECK(standbyStatus(v), 0x0000e1c2);
+  CHECK(standbyRawZoom(v), 0x00);
+  CHECK(standbyRawFocus(v), 0x0c);
+  CHECK(standbyFocusDistance(v), 0x0042);
+  CHECK(standbyAperture(v), 0x03b1);
+  CHECK(standbyScaledZoom(v), 0x0c00);
+  CHECK(standbyFocusPosition(v), 0x000c);
+
+  // Ten times the f-number, from Av in 1/256 EV
+  CHECK(apertureFNumber10(standbyAperture(v)), 36); // f/3.6
+  CHECK(apertureFNumber10(0x0000), 10); // Av 0, f/1
+  CHECK(apertureFNumber10(0x0200), 20); // Av 2, f/2
+  CHECK(apertureFNumber10(0x0180), 17); // Av 1.5, f/1.7
+  CHECK(apertureFNumber10(0x0500), 57); // Av 5, f/5.7
+  CHECK(apertureFNumber10(0x0800), 160); // Av 8, f/16
+  CHECK(apertureFNumber10(0x0dff), 1278); // Just under f/128
+  CHECK(apertureFNumber10(0x0e00), 0xffff); // f/128 and up
+
+  // Writing a field changes only its own bytes, in place
+  standbySetAperture(v, 0x03b2);
+  CHECK(standbyAperture(v), 0x03b2);
+  CHECK(payload[STANDBY_APERTURE], 0xb2);
+  CHECK(payload[STANDBY_APERTURE + 1], 0x03);
+  CHECK(memcmp(payload, dump + 1, STANDBY_APERTURE), 0);
+  CHECK(memcmp(payload + STANDBY_APERTURE + 2, dump + 1 + STANDBY_APERTURE + 2,
+               STANDBY_BYTES - STANDBY_APERTURE - 2), 0);
+
+  // The snapshot keeps the checksum of each copy as fields change
+  StandbySnapshot s;
+  standbySnapshotBegin(s, dump + 1);
+  CHECK(standbyBeginUpdate(s), true);
+  standbyPut16(s, STANDBY_APERTURE, 0x0400);
+  standbyPublish(s);
+  uint8 sum = 0;
+  for(uint8 i = 0; i < STANDBY_BYTES; i++){
+    sum += s.bytes[s.front][i];
+  }
+  CHECK(s.checksum[s.front], sum);
+  CHECK(standbyAperture(standbyView(s.bytes[s.front])), 0x0400);
+
+  if(failures){
+    printf("%d checks failed\n", failures);
+    return(1);
+  }
+  printf("All standby checks passed\n");
+  return(0);
+}
@@ -0,0 +1,98 @@
+/* telemetry.cpp
+ * Interrupt-driven binary stream out of USART1.  See telemetry.h.
+ */
+
+#include "telemetry.h"
+#include "hal.h"
+
+/* The indices are 8 bits, so the buffer is exactly 256 bytes and they wrap
+ * around by themselves.  Only telemetrySend() moves head and only the
+ * interrupt moves tail, so neither needs to lock out the other. */
+static uint8 buffer[256];
+static volatile uint8 head = 0; // Next byte to fill
+static volatile uint8 tail = 0; // Next byte to send
+
+static uint16 sequence = 0;
+static uint16 dropped = 0;
+
+void telemetryBegin()
+{
+  uart1Begin(TELEMETRY_BAUD);
+}
+
+/* Queues a frame, whose payload is the prefix bytes followed by nBytes from
+ * payload.  Returns false, without waiting, if there wasn't room for it. */
+static bool send(uint8 type, const uint8* prefix, uint8 nPrefix,
+                 const uint8* payload, uint8 nBytes)
+{
+  uint16 seq = sequence++;
+  uint8 h = head;
+  uint8 space = tail - h - 1;
+  uint8 length = nPrefix + nBytes;
+  if(space < length + TELEMETRY_OVERHEAD){
+    dropped++;
+    return(false);
+  }
+
+  uint32 time = micros();
+  uint8 header[8] = {type, (uint8)seq, (uint8)(seq >> 8),
+                     (uint8)time, (uint8)(time >> 8),
+                     (uint8)(time >> 16), (uint8)(time >> 24), length};
+  uint8 checksum = 0;
+
+  buffer[h++] = TELEMETRY_SYNC0;
+  buffer[h++] = TELEMETRY_SYNC1;
+  for(uint8 i = 0; i < sizeof(header); i++){
+    buffer[h++] = header[i];
+    checksum += header[i];
+  }
+  for(uint8 i = 0; i < nPrefix; i++){
+    buffer[h++] = prefix[i];
+    checksum += prefix[i];
+  }
+  for(uint8 i = 0; i < nBytes; i++){
+    buffer[h++] = payload[i];
+    checksum += payload[i];
+  }
+  buffer[h++] = checksum;
+
+  head = h; // Only now can the interrupt see the frame
+  uart1InterruptEnable();
+  return(true);
+}
+
+bool telemetrySend(uint8 type, const uint8* payload, uint8 nBytes)
+{
+  return(send(type, NULL, 0, payload, nBytes));
+}
+
+// Same, with a tag and status ahead of the payload, as an ack has
+bool telemetrySend(uint8 type, uint8 tag, uint8 status, const uint8* payload, uint8 nBytes)
+{
+  uint8 prefix[2] = {tag, status};
+  return(send(type, prefix, sizeof(prefix), payload, nBytes));
+}
+
+// Largest payload that would fit in the buffer right now
+uint8 telemetryRoom()
+{
+  uint8 space = tail - head - 1;
+  return(space > TELEMETRY_OVERHEAD ? space - TELEMETRY_OVERHEAD : 0);
+}
+
+// Frames dropped so far because the buffer was full
+uint16 telemetryDropped()
+{
+  return(dropped);
+}
+
+ISR(USART1_UDRE_vect)
+{
+  if(tail != head){
+    uart1Write(buffer[tail]);
+    tail = tail + 1;
+  }
+  else{
+    uart1InterruptDisable();
+  }
+}
@@ -0,0 +1,47 @@
+/* telemetry.h
+ * Binary stream of standby responses out of the second serial port (TX1, pin
+ * 18), so that the lens state can be logged at the full polling rate without
+ * the bus loop ever waiting on a UART.  Replies to the host's commands (see
+ * control.h) go the same way.
+ *
+ * Frames are queued whole into a ring buffer which the USART1 interrupt
+ * drains a byte at a time.  If there isn't room for a whole frame, it is
+ * dropped and counted.  Each frame is, multi-byte fields LSB first:
+ *   0xa5 0x5a     Sync
+ *   type (1)      One of the TELEMETRY_ types below
+ *   sequence (2)  Counts every frame, dropped or not, so gaps show up
+ *   time (4)      micros() when the frame was queued
+ *   length (1)    Number of payload bytes
+ *   payload
+ *   checksum (1)  8-bit sum of everything from the type on
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include "typedef.h"
+
+// 500 kbaud is exact at 16 MHz, and fast enough for ~1000 standby frames/s
+#define TELEMETRY_BAUD 500000
+
+#define TELEMETRY_SYNC0 0xa5
+#define TELEMETRY_SYNC1 0x5a
+
+// Frame types
+#define TELEMETRY_STANDBY 0x01 // Payload is a standby response
+#define TELEMETRY_ACK 0x02 // Tag, status, and then a standby response
+#define TELEMETRY_TRACE 0x03 // A recorded bus transaction (see recorder.h)
+#define TELEMETRY_FOCUS 0x04 // A finished focus move (see focus.h): target (2),
+                             // position (2), settle time in us (4), overshoot (2),
+                             // corrections, with FOCUS_SETTLED if it did (1)
+
+// Bytes of each frame besides the payload
+#define TELEMETRY_OVERHEAD 11
+
+void telemetryBegin();
+bool telemetrySend(uint8 type, const uint8* payload, uint8 nBytes);
+bool telemetrySend(uint8 type, uint8 tag, uint8 status, const uint8* payload, uint8 nBytes);
+uint16 telemetryDropped();
+uint8 telemetryRoom();
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,107 @@
+/* zoomtrack.cpp
+ * Zoom calibration and focus tracking.  See zoomtrack.h.
+ */
+
+#include "zoomtrack.h"
+
+static uint16 samples[ZOOM_TABLE_POINTS];
+static uint32 sampled; // Bit mask of the points that have a sample
+
+static uint8 trackedZoom; // Raw zoom the focus was last moved for
+static bool tracking = false; // False until there's a zoom to track from
+
+// Starts a calibration from scratch
+void zoomCalibrateStart()
+{
+  sampled = 0;
+}
+
+// Takes the focus at the current zoom, if the zoom is close to a point
+void zoomCalibrateSample(StandbyView v)
+{
+  uint8 zoom = standbyRawZoom(v);
+  uint8 point = (zoom + (1 << (ZOOM_TABLE_SHIFT - 1))) >> ZOOM_TABLE_SHIFT;
+  int16 off = (int16)zoom - (point << ZOOM_TABLE_SHIFT);
+  if(off <= ZOOM_CAPTURE && off >= -ZOOM_CAPTURE){
+    samples[point] = standbyFocusPosition(v);
+    sampled |= (uint32)1 << point;
+  }
+}
+
+/* Finishes a calibration, filling in the points that weren't sampled by
+ * interpolating between the nearest ones that were, or copying the
+ * nearest one past either end.  Returns false, and leaves the table alone,
+ * if fewer than two points were sampled. */
+bool zoomCalibrateFinish(ZoomTable& t)
+{
+  int8 last = -1; // Last sampled point so far
+  uint8 count = 0;
+  for(uint8 i = 0; i < ZOOM_TABLE_POINTS; i++){
+    if(!(sampled & ((uint32)1 << i))){
+      continue;
+    }
+    if(last < 0){
+      for(uint8 j = 0; j < i; j++){
+        samples[j] = samples[i];
+      }
+    }
+    else{
+      int32 span = (int32)samples[i] - samples[last];
+      for(uint8 j = last + 1; j < i; j++){
+        samples[j] = samples[last] + span * (j - last) / (i - last);
+      }
+    }
+    last = i;
+    count++;
+  }
+  if(count < 2){
+    return(false);
+  }
+  for(uint8 j = last + 1; j < ZOOM_TABLE_POINTS; j++){
+    samples[j] = samples[last];
+  }
+
+  for(uint8 i = 0; i < ZOOM_TABLE_POINTS; i++){
+    t.focus[i] = samples[i];
+  }
+  t.calibrated = true;
+  return(true);
+}
+
+// Returns the in-focus position for a raw zoom, between the points around it
+uint16 zoomFocus(const ZoomTable& t, uint8 zoom)
+{
+  uint8 i = zoom >> ZOOM_TABLE_SHIFT;
+  uint8 frac = zoom & ((1 << ZOOM_TABLE_SHIFT) - 1);
+  int32 span = (int32)t.focus[i + 1] - t.focus[i];
+  return(t.focus[i] + ((span * frac) >> ZOOM_TABLE_SHIFT));
+}
+
+// Starts tracking again from the next standby packet
+void zoomTrackStart()
+{
+  tracking = false;
+}
+
+/* Checks the zoom in the latest standby packet.  Returns true if it has
+ * changed since the focus was last moved for it, with the focus position to
+ * move to.  Only call it when the focus is free to move; until then, the
+ * change keeps. */
+bool zoomTrack(const ZoomTable& t, StandbyView v, uint16& target)
+{
+  uint8 zoom = standbyRawZoom(v);
+  if(!tracking){
+    tracking = true;
+    trackedZoom = zoom;
+    return(false);
+  }
+  if(zoom == trackedZoom){
+    return(false);
+  }
+
+  int32 moved = (int32)standbyFocusPosition(v) +
+                zoomFocus(t, zoom) - zoomFocus(t, trackedZoom);
+  target = moved < 0 ? 0 : moved > 0xffff ? 0xffff : moved;
+  trackedZoom = zoom;
+  return(true);
+}
@@ -0,0 +1,39 @@
+/* zoomtrack.h
+ * Keeping the focus where it was as the zoom changes, for fakebody.
+ *
+ * On most zooms the point of focus moves as the lens zooms, so a subject
+ * that was sharp goes soft.  A calibrated table (ZoomTable, in the lens'
+ * record in EEPROM) says where the focus should be at each zoom setting for
+ * one subject distance.  While tracking, whenever the raw zoom in the
+ * standby packet changes, the focus is moved by however much the table
+ * changes between the old zoom and the new one, which holds whatever
+ * distance it was focused at to first order.  Looking a zoom up is a shift,
+ * a mask and one interpolation, so it costs next to nothing in a frame.
+ *
+ * The body can't drive the zoom or see the image, so calibration is done by
+ * whoever can: the operator (or the host, which can see the image) zooms
+ * slowly through the range, keeping the image in focus, while every
+ * standby packet is sampled.  Each point of the table takes the focus last
+ * seen within ZOOM_CAPTURE of its zoom.  Points that were never reached
+ * are filled in from their neighbours at the end.
+ */
+
+#ifndef ZOOMTRACK_H_
+#define ZOOMTRACK_H_
+
+#include "typedef.h"
+#include "standby.h"
+#include "lensrecord.h"
+
+// How close the raw zoom has to be to a point of the table to calibrate it
+#define ZOOM_CAPTURE 2
+
+void zoomCalibrateStart();
+void zoomCalibrateSample(StandbyView v);
+bool zoomCalibrateFinish(ZoomTable& t);
+
+uint16 zoomFocus(const ZoomTable& t, uint8 zoom);
+void zoomTrackStart();
+bool zoomTrack(const ZoomTable& t, StandbyView v, uint16& target);
+
+#endif /* ZOOMTRACK_H_ */
@@ -0,0 +1,111 @@
+/* zoomtracktest.cpp
+ * Host-side check of zoom calibration and focus tracking in zoomtrack.cpp:
+ * filling in a table from a few samples, interpolating between its points,
+ * and what happens at either end of it.  Build and run it on the host (see
+ * the README); it prints each check that fails, and exits with 1 if any did.
+ */
+
+#include <stdio.h>
+#include "zoomtrack.h"
+
+static int failures = 0;
+
+#define CHECK(got, expected) check(#got, (got), (expected))
+
+static void check(const char* what, unsigned long got, unsigned long expected)
+{
+  if(got != expected){
+    printf("%s: got 0x%lx, expected 0x%lx\n", what, got, expected);
+    failures++;
+  }
+}
+
+static uint8 payload[STANDBY_BYTES];
+static StandbyView v = standbyView(payload);
+
+// Puts a raw zoom and focus position in the standby packet
+static StandbyView at(uint8 zoom, uint16 position)
+{
+  payload[STANDBY_RAW_ZOOM] = zoom;
+  standbySetField16(v, STANDBY_FOCUS_POSITION, position);
+  return(v);
+}
+
+int main()
+{
+  ZoomTable t;
+
+  // Between two points the focus is interpolated, and on one it's exact
+  for(uint8 i = 0; i < ZOOM_TABLE_POINTS; i++){
+    t.focus[i] = 100 * i;
+  }
+  CHECK(zoomFocus(t, 0x00), 0);
+  CHECK(zoomFocus(t, 0x10), 100);
+  CHECK(zoomFocus(t, 0x18), 150);
+  CHECK(zoomFocus(t, 0x1c), 175);
+  CHECK(zoomFocus(t, 0xf0), 1500);
+  CHECK(zoomFocus(t, 0xff), 1593); // Short of the last point, never past it
+  t.focus[1] = 300;
+  t.focus[2] = 100; // Falling as well as rising
+  CHECK(zoomFocus(t, 0x14), 250);
+
+  // A zoom only counts towards a point within ZOOM_CAPTURE of it
+  zoomCalibrateStart();
+  zoomCalibrateSample(at(0x20 + ZOOM_CAPTURE + 1, 999));
+  zoomCalibrateSample(at(0x60 - ZOOM_CAPTURE - 1, 999));
+  CHECK(zoomCalibrateFinish(t), false);
+  zoomCalibrateSample(at(0x20 - ZOOM_CAPTURE, 250));
+  zoomCalibrateSample(at(0x20 + ZOOM_CAPTURE, 300)); // The last one keeps
+  CHECK(zoomCalibrateFinish(t), false); // Only one point, so the table stays
+  CHECK(t.focus[1], 300);
+  CHECK(t.focus[2], 100);
+
+  // Points between two samples are filled in along the line between them,
+  // and those past the ends copy the nearest sample
+  zoomCalibrateSample(at(0x60 + ZOOM_CAPTURE, 700));
+  t.calibrated = false;
+  CHECK(zoomCalibrateFinish(t), true);
+  CHECK(t.calibrated, true);
+  const uint16 filled[ZOOM_TABLE_POINTS] = {300, 300, 300, 400, 500, 600, 700,
+    700, 700, 700, 700, 700, 700, 700, 700, 700, 700};
+  for(uint8 i = 0; i < ZOOM_TABLE_POINTS; i++){
+    CHECK(t.focus[i], filled[i]);
+  }
+  CHECK(zoomFocus(t, 0x00), 300); // Flat past either end
+  CHECK(zoomFocus(t, 0xff), 700);
+  CHECK(zoomFocus(t, 0x48), 550);
+
+  // The last point is reached from the very top of the zoom
+  zoomCalibrateStart();
+  zoomCalibrateSample(at(0x00, 1000));
+  zoomCalibrateSample(at(0xff, 0));
+  CHECK(zoomCalibrateFinish(t), true);
+  CHECK(t.focus[0], 1000);
+  CHECK(t.focus[8], 500);
+  CHECK(t.focus[ZOOM_TABLE_POINTS - 1], 0);
+
+  // Tracking moves the focus by however much the table changes, from where
+  // the lens is now, and only once the zoom has moved
+  uint16 target;
+  zoomTrackStart();
+  CHECK(zoomTrack(t, at(0x00, 2000), target), false);
+  CHECK(zoomTrack(t, at(0x00, 2000), target), false);
+  CHECK(zoomTrack(t, at(0x40, 2000), target), true);
+  CHECK(target, 1750);
+  CHECK(zoomTrack(t, at(0x40, 1750), target), false);
+  CHECK(zoomTrack(t, at(0x20, 1750), target), true);
+  CHECK(target, 1875);
+
+  // It stops at either end of the focus range rather than wrapping
+  CHECK(zoomTrack(t, at(0xff, 100), target), true);
+  CHECK(target, 0);
+  CHECK(zoomTrack(t, at(0x00, 0xff00), target), true);
+  CHECK(target, 0xffff);
+
+  if(failures){
+    printf("%d checks failed\n", failures);
+    return(1);
+  }
+  printf("All zoom tracking checks passed\n");
+  return(0);
+}